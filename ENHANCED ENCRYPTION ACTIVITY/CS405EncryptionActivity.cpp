@@ -1,28 +1,91 @@
-﻿#include <cassert>
+﻿#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cassert>
+#include <cerrno>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <span>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <ctime>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ENCRYPTION_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ENCRYPTION_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX2/AVX-512/AES-NI instructions inside functions that opt in to them;
+// MSVC always accepts the intrinsics, so the attributes expand to nothing there.
+#if defined(ENCRYPTION_X86) && defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_AESNI __attribute__((target("aes,ssse3")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define TARGET_AESNI
+#endif
+
 /// <summary>
-/// Encrypts or decrypts a string using XOR with the given key.
-/// XOR is symmetric, so the same logic applies for both operations.
+/// Reference implementation of the XOR transform: one byte per iteration with the key
+/// index taken modulo the key length. The vectorized kernels are checked against it.
 /// </summary>
-/// <param name="source">The string to be transformed (either plaintext or ciphertext)</param>
+/// <param name="source">The string to be transformed</param>
 /// <param name="key">The key used to encrypt or decrypt</param>
 /// <returns>The resulting transformed string</returns>
-std::string encrypt_decrypt(const std::string& source, const std::string& key)
+std::string encrypt_decrypt_reference(const std::string& source, const std::string& key)
 {
     const auto key_length = key.length();
     const auto source_length = source.length();
 
-    // Ensure both key and source strings are not empty
     assert(key_length > 0 && source_length > 0);
 
     std::string output = source;
 
-    // Perform XOR operation between source characters and key (key repeats if shorter)
     for (size_t i = 0; i < source_length; ++i)
     {
         output[i] = source[i] ^ key[i % key_length];
@@ -32,114 +95,7867 @@ std::string encrypt_decrypt(const std::string& source, const std::string& key)
 }
 
 /// <summary>
-/// Reads the entire contents of a file into a single string.
-/// Supports binary mode for handling any type of data.
+/// Signature shared by every XOR kernel: dst[i] = src[i] ^ key_stream[i] for i in [0, length).
+/// dst may alias src for in-place transforms.
 /// </summary>
-/// <param name="filename">Name of the file to read</param>
-/// <returns>File contents as a string, or empty string if reading fails</returns>
-std::string read_file(const std::string& filename)
+using XorBlockFunction = void (*)(unsigned char* dst, const unsigned char* src,
+                                  const unsigned char* key_stream, size_t length);
+
+/// <summary>
+/// Plain byte-at-a-time kernel, used for tails and as the last-resort fallback.
+/// </summary>
+void xor_block_scalar(unsigned char* dst, const unsigned char* src,
+                      const unsigned char* key_stream, size_t length)
 {
-    std::ifstream input_file_stream(filename, std::ios::in | std::ios::binary);
-    if (!input_file_stream)
+    for (size_t i = 0; i < length; ++i)
     {
-        std::cerr << "Unable to open file: " << filename << std::endl;
-        return "";
+        dst[i] = src[i] ^ key_stream[i];
     }
+}
 
-    std::ostringstream ss;
-    ss << input_file_stream.rdbuf();
-    return ss.str();
+/// <summary>
+/// Portable kernel that XORs 64-bit words. memcpy keeps the unaligned loads well-defined
+/// and compiles down to single mov instructions.
+/// </summary>
+void xor_block_word64(unsigned char* dst, const unsigned char* src,
+                      const unsigned char* key_stream, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        uint64_t s[4];
+        uint64_t k[4];
+        std::memcpy(s, src + i, sizeof(s));
+        std::memcpy(k, key_stream + i, sizeof(k));
+        s[0] ^= k[0];
+        s[1] ^= k[1];
+        s[2] ^= k[2];
+        s[3] ^= k[3];
+        std::memcpy(dst + i, s, sizeof(s));
+    }
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t s;
+        uint64_t k;
+        std::memcpy(&s, src + i, sizeof(s));
+        std::memcpy(&k, key_stream + i, sizeof(k));
+        s ^= k;
+        std::memcpy(dst + i, &s, sizeof(s));
+    }
+    xor_block_scalar(dst + i, src + i, key_stream + i, length - i);
 }
 
+#if defined(ENCRYPTION_X86)
 /// <summary>
-/// Writes a string to a file in binary mode.
-/// Overwrites existing content if the file already exists.
+/// SSE2 kernel, 64 bytes per iteration. SSE2 is part of the x86-64 baseline.
 /// </summary>
-/// <param name="filename">Name of the file to write</param>
-/// <param name="content">The content to write to the file</param>
-void write_file(const std::string& filename, const std::string& content)
+void xor_block_sse2(unsigned char* dst, const unsigned char* src,
+                    const unsigned char* key_stream, size_t length)
 {
-    std::ofstream output_file_stream(filename, std::ios::out | std::ios::binary);
-    if (!output_file_stream)
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
     {
-        std::cerr << "Unable to open file for writing: " << filename << std::endl;
-        return;
+        const __m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+        const __m128i s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32));
+        const __m128i s3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48));
+        const __m128i k0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i));
+        const __m128i k1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i + 16));
+        const __m128i k2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i + 32));
+        const __m128i k3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i + 48));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(s0, k0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), _mm_xor_si128(s1, k1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 32), _mm_xor_si128(s2, k2));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 48), _mm_xor_si128(s3, k3));
+    }
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_stream + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(s, k));
     }
+    xor_block_scalar(dst + i, src + i, key_stream + i, length - i);
+}
 
-    output_file_stream << content;
+/// <summary>
+/// AVX2 kernel, 128 bytes per iteration.
+/// </summary>
+TARGET_AVX2 void xor_block_avx2(unsigned char* dst, const unsigned char* src,
+                                const unsigned char* key_stream, size_t length)
+{
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        const __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+        const __m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 64));
+        const __m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 96));
+        const __m256i k0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_stream + i));
+        const __m256i k1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_stream + i + 32));
+        const __m256i k2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_stream + i + 64));
+        const __m256i k3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_stream + i + 96));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(s0, k0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_xor_si256(s1, k1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 64), _mm256_xor_si256(s2, k2));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 96), _mm256_xor_si256(s3, k3));
+    }
+    for (; i + 32 <= length; i += 32)
+    {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key_stream + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(s, k));
+    }
+    xor_block_scalar(dst + i, src + i, key_stream + i, length - i);
 }
 
 /// <summary>
-/// Compares the contents of two files and checks for exact byte-by-byte match.
-/// Used to verify the decrypted file matches the original input file.
+/// AVX-512 kernel, 256 bytes per iteration.
 /// </summary>
-/// <param name="file1">Path to the original file</param>
-/// <param name="file2">Path to the decrypted file</param>
-/// <returns>True if files are identical, false otherwise</returns>
-bool compare_files(const std::string& file1, const std::string& file2)
+TARGET_AVX512 void xor_block_avx512(unsigned char* dst, const unsigned char* src,
+                                    const unsigned char* key_stream, size_t length)
+{
+    size_t i = 0;
+    for (; i + 256 <= length; i += 256)
+    {
+        const __m512i s0 = _mm512_loadu_si512(src + i);
+        const __m512i s1 = _mm512_loadu_si512(src + i + 64);
+        const __m512i s2 = _mm512_loadu_si512(src + i + 128);
+        const __m512i s3 = _mm512_loadu_si512(src + i + 192);
+        const __m512i k0 = _mm512_loadu_si512(key_stream + i);
+        const __m512i k1 = _mm512_loadu_si512(key_stream + i + 64);
+        const __m512i k2 = _mm512_loadu_si512(key_stream + i + 128);
+        const __m512i k3 = _mm512_loadu_si512(key_stream + i + 192);
+        _mm512_storeu_si512(dst + i, _mm512_xor_si512(s0, k0));
+        _mm512_storeu_si512(dst + i + 64, _mm512_xor_si512(s1, k1));
+        _mm512_storeu_si512(dst + i + 128, _mm512_xor_si512(s2, k2));
+        _mm512_storeu_si512(dst + i + 192, _mm512_xor_si512(s3, k3));
+    }
+    for (; i + 64 <= length; i += 64)
+    {
+        const __m512i s = _mm512_loadu_si512(src + i);
+        const __m512i k = _mm512_loadu_si512(key_stream + i);
+        _mm512_storeu_si512(dst + i, _mm512_xor_si512(s, k));
+    }
+    xor_block_scalar(dst + i, src + i, key_stream + i, length - i);
+}
+
+/// <summary>
+/// Runs CPUID leaf/subleaf and stores EAX, EBX, ECX, EDX in regs.
+/// </summary>
+void query_cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i)
+    {
+        regs[i] = static_cast<unsigned>(info[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/// <summary>
+/// Reads XCR0 to find out which register states the operating system saves on a context
+/// switch. A CPU may advertise AVX while the OS has not enabled it.
+/// </summary>
+uint64_t read_xcr0()
 {
-    std::string content1 = read_file(file1);
-    std::string content2 = read_file(file2);
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax = 0;
+    unsigned edx = 0;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
 
-    // Check if either file failed to read
-    if (content1.empty() || content2.empty())
+bool cpu_has_avx2()
+{
+    unsigned regs[4];
+    query_cpuid(0, 0, regs);
+    if (regs[0] < 7)
     {
-        std::cerr << "Error: One or both files could not be read for comparison.\n";
         return false;
     }
 
-    // Compare content
-    if (content1 == content2)
+    query_cpuid(1, 0, regs);
+    const bool osxsave = (regs[2] & (1u << 27)) != 0;
+    const bool avx = (regs[2] & (1u << 28)) != 0;
+    if (!osxsave || !avx || (read_xcr0() & 0x6) != 0x6)
     {
-        std::cout << "SUCCESS: Decrypted file matches original input.\n";
-        return true;
+        return false;
     }
-    else
+
+    query_cpuid(7, 0, regs);
+    return (regs[1] & (1u << 5)) != 0;
+}
+
+bool cpu_has_avx512f()
+{
+    if (!cpu_has_avx2())
+    {
+        return false;
+    }
+
+    // XMM, YMM, opmask and both halves of the ZMM state must all be enabled
+    if ((read_xcr0() & 0xE6) != 0xE6)
     {
-        std::cout << "ERROR: Decrypted file does NOT match the original input.\n";
         return false;
     }
+
+    unsigned regs[4];
+    query_cpuid(7, 0, regs);
+    return (regs[1] & (1u << 16)) != 0;
+}
+
+bool cpu_has_aesni()
+{
+    // AES-NI for the rounds, SSSE3 for the byte shuffle that builds big-endian counters
+    unsigned regs[4];
+    query_cpuid(1, 0, regs);
+    return (regs[2] & (1u << 25)) != 0 && (regs[2] & (1u << 9)) != 0;
+}
+#endif
+
+bool always_supported()
+{
+    return true;
 }
 
 /// <summary>
-/// Main program function that:
-/// 1. Reads input data from a file
-/// 2. Encrypts the data using XOR
-/// 3. Saves the encrypted result
-/// 4. Decrypts the encrypted string
-/// 5. Saves the decrypted result
-/// 6. Verifies the decrypted output matches the original input
+/// An XOR kernel together with the name used in diagnostics and a CPU feature check.
 /// </summary>
-int main()
+struct XorKernel
 {
-    std::cout << "Encryption and Decryption Program\n";
+    const char* name;
+    XorBlockFunction function;
+    bool (*is_supported)();
+};
 
-    // File paths and secret key
-    const std::string input_filename = "inputdatafile.txt";
-    const std::string encrypted_filename = "encrypted_output.txt";
-    const std::string decrypted_filename = "decrypted_output.txt";
-    const std::string key = "password";
+/// <summary>
+/// Every kernel compiled into this build, fastest first.
+/// </summary>
+const XorKernel xor_kernels[] = {
+#if defined(ENCRYPTION_X86)
+    { "avx512", xor_block_avx512, cpu_has_avx512f },
+    { "avx2", xor_block_avx2, cpu_has_avx2 },
+    { "sse2", xor_block_sse2, always_supported },
+#endif
+    { "word64", xor_block_word64, always_supported },
+    { "scalar", xor_block_scalar, always_supported },
+};
+
+/// <summary>
+/// Returns the fastest kernel the running CPU supports. CPUID is only queried once.
+/// </summary>
+const XorKernel& active_xor_kernel()
+{
+    static const XorKernel& selected = []() -> const XorKernel& {
+        for (const XorKernel& kernel : xor_kernels)
+        {
+            if (kernel.is_supported())
+            {
+                return kernel;
+            }
+        }
+        return xor_kernels[sizeof(xor_kernels) / sizeof(xor_kernels[0]) - 1];
+    }();
+    return selected;
+}
+
+// Keys shorter than this are widened into a repeated pattern so every call into a
+// kernel covers at least this many bytes.
+const size_t min_key_segment = 1024;
+const size_t key_pattern_capacity = 2 * min_key_segment;
 
-    // Step 1: Read input from file
-    std::string original_content = read_file(input_filename);
-    if (original_content.empty())
+/// <summary>
+/// XORs length bytes of src with the repeating key, starting key_offset bytes into the
+/// key, and stores the result in dst (which may alias src).
+/// The data is walked in segments that line up with one period of the key, so each
+/// segment is a straight buffer-against-buffer XOR with no per-byte modulo.
+/// </summary>
+void xor_with_repeating_key(unsigned char* dst, const unsigned char* src, size_t length,
+                            const unsigned char* key, size_t key_length, size_t key_offset,
+                            XorBlockFunction kernel)
+{
+    unsigned char pattern[key_pattern_capacity];
+    const unsigned char* period_bytes = key;
+    size_t period = key_length;
+
+    if (key_length < min_key_segment)
     {
-        std::cerr << "No content read from input file. Exiting." << std::endl;
-        return 1;
+        const size_t repeats = key_pattern_capacity / key_length;
+        period = repeats * key_length;
+        for (size_t i = 0; i < period; i += key_length)
+        {
+            std::memcpy(pattern + i, key, key_length);
+        }
+        period_bytes = pattern;
+    }
+
+    // The pattern is a whole number of keys, so the phase within it maps back to the same key byte
+    size_t phase = key_offset % period;
+    while (length > 0)
+    {
+        const size_t run = std::min(length, period - phase);
+        kernel(dst, src, period_bytes + phase, run);
+        dst += run;
+        src += run;
+        length -= run;
+        phase = 0;
     }
+}
 
-    // Step 2: Encrypt the input
-    std::string encrypted_content = encrypt_decrypt(original_content, key);
-    write_file(encrypted_filename, encrypted_content);
-    std::cout << "Encrypted file saved as: " << encrypted_filename << std::endl;
+/// <summary>
+/// A symmetric stream cipher: output = input XOR keystream, where the keystream byte at any
+/// position can be produced without generating the ones before it. Encryption and
+/// decryption are the same call, and any range of a stream can be processed on its own,
+/// which is what the chunked parallel, streaming and mmap modes rely on.
+/// apply(dst, src, length, offset) transforms length bytes of src into dst (which may alias
+/// src); offset is the position of src[0] in the overall stream.
+/// Ciphers are plain classes rather than implementations of a virtual interface: the engine
+/// and the I/O drivers are templates over the cipher type, so the per-chunk call is direct
+/// and can be inlined.
+/// </summary>
+template <typename T>
+concept StreamCipher = requires(const T& cipher, unsigned char* dst, const unsigned char* src, size_t length,
+                                uint64_t offset) {
+    cipher.apply(dst, src, length, offset);
+    { cipher.name() } -> std::convertible_to<const char*>;
+};
 
-    // Step 3: Decrypt the encrypted content
-    std::string decrypted_content = encrypt_decrypt(encrypted_content, key);
-    write_file(decrypted_filename, decrypted_content);
-    std::cout << "Decrypted file saved as: " << decrypted_filename << std::endl;
+// The expanded key stream is aligned to, and a multiple of, the widest vector register
+const size_t key_stream_alignment = 64;
+// The expanded block is made at least this long, so segments are long even for tiny keys...
+const size_t key_stream_min_period = 4096;
+// ...and at most this long before odd key lengths give up on a vector-width multiple
+const size_t key_stream_max_period = 256u << 10;
 
-    // Step 4: Compare decrypted file with original
-    compare_files(input_filename, decrypted_filename);
+/// <summary>
+/// A key expanded once into an aligned block that repeats it a whole number of times.
+/// The block length is a multiple of lcm(key length, 64), so once the first partial segment
+/// is done every pass over the block starts at phase 0 on a 64-byte boundary and the hot loop
+/// is a plain vector XOR of the source against the block. This matters most for odd key
+/// lengths (7, 33, ...), where the on-the-fly pattern would wrap at a different vector lane
+/// on every pass.
+/// </summary>
+class KeyStream
+{
+public:
+    explicit KeyStream(std::string_view key, XorBlockFunction kernel = active_xor_kernel().function)
+        : m_key_length(key.length()),
+          m_kernel(kernel)
+    {
+        assert(!key.empty());
 
-    return 0;
-}
\ No newline at end of file
+        // Keys whose lcm with the vector width would be huge fall back to whole keys only
+        const size_t vector_period = std::lcm(key.length(), key_stream_alignment);
+        const size_t unit = vector_period <= key_stream_max_period ? vector_period : key.length();
+        m_period = unit * ((key_stream_min_period + unit - 1) / unit);
+
+        m_block.reset(static_cast<unsigned char*>(::operator new[](m_period, std::align_val_t(key_stream_alignment))));
+        for (size_t i = 0; i < m_period; i += key.length())
+        {
+            std::memcpy(m_block.get() + i, key.data(), key.length());
+        }
+    }
+
+    const char* name() const { return "xor"; }
+    size_t key_length() const { return m_key_length; }
+    size_t period() const { return m_period; }
+
+    /// <summary>
+    /// XORs length bytes of src into dst (which may alias src); key_offset is the position
+    /// of src[0] in the overall stream.
+    /// </summary>
+    void apply(unsigned char* dst, const unsigned char* src, size_t length, uint64_t key_offset) const
+    {
+        // The block holds whole keys, so the phase within it maps back to the same key byte
+        size_t phase = static_cast<size_t>(key_offset % m_period);
+        while (length > 0)
+        {
+            const size_t run = std::min(length, m_period - phase);
+            m_kernel(dst, src, m_block.get() + phase, run);
+            dst += run;
+            src += run;
+            length -= run;
+            phase = 0;
+        }
+    }
+
+private:
+    struct AlignedDelete
+    {
+        void operator()(unsigned char* block) const
+        {
+            ::operator delete[](block, std::align_val_t(key_stream_alignment));
+        }
+    };
+
+    size_t m_key_length;
+    size_t m_period = 0;
+    XorBlockFunction m_kernel;
+    std::unique_ptr<unsigned char[], AlignedDelete> m_block;
+};
+
+// FixedKeyXor transforms runs up to this long itself. Longer runs go to the CPUID-selected
+// kernel, which is wider than the vector width fixed at build time on most CPUs (the MSVC
+// project targets SSE2), and overtakes the inline loop well before a 256 KB engine chunk.
+const size_t fixed_key_inline_limit = 256;
+
+/// <summary>
+/// Repeating-key XOR for a key length known at compile time. KeyLength must divide 64, so
+/// a 64-byte window of the key pattern is the same at every vector position: the window
+/// for the starting phase is loaded into registers once and the loop is a straight XOR
+/// against them, with no key-stream loads and no call through a kernel pointer. The
+/// vector width is the widest the build targets (__AVX2__, otherwise SSE2), so only runs
+/// up to fixed_key_inline_limit are done this way; longer ones use a KeyStream.
+/// </summary>
+template <size_t KeyLength>
+class FixedKeyXor
+{
+    static_assert(KeyLength > 0 && key_stream_alignment % KeyLength == 0, "KeyLength must divide 64");
+
+public:
+    explicit FixedKeyXor(std::string_view key)
+        : m_stream(key)
+    {
+        assert(key.length() == KeyLength);
+        for (size_t i = 0; i < sizeof(m_pattern); ++i)
+        {
+            m_pattern[i] = static_cast<unsigned char>(key[i % KeyLength]);
+        }
+    }
+
+    const char* name() const { return "xor"; }
+
+    void apply(unsigned char* dst, const unsigned char* src, size_t length, uint64_t key_offset) const
+    {
+        if (length > fixed_key_inline_limit)
+        {
+            m_stream.apply(dst, src, length, key_offset);
+            return;
+        }
+
+        // Any 64 bytes of the doubled pattern starting below 64 hold one full window
+        const unsigned char* window = m_pattern + key_offset % KeyLength;
+        size_t i = 0;
+#if defined(ENCRYPTION_X86) && defined(__AVX2__)
+        const __m256i k0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(window));
+        const __m256i k1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(window + 32));
+        for (; i + 64 <= length; i += 64)
+        {
+            const __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            const __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(s0, k0));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_xor_si256(s1, k1));
+        }
+#elif defined(ENCRYPTION_X86)
+        const __m128i k0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window));
+        const __m128i k1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window + 16));
+        const __m128i k2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window + 32));
+        const __m128i k3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window + 48));
+        for (; i + 64 <= length; i += 64)
+        {
+            const __m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+            const __m128i s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32));
+            const __m128i s3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(s0, k0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), _mm_xor_si128(s1, k1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 32), _mm_xor_si128(s2, k2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 48), _mm_xor_si128(s3, k3));
+        }
+#endif
+        for (; i + 8 <= length; i += 8)
+        {
+            uint64_t s;
+            uint64_t k;
+            std::memcpy(&s, src + i, sizeof(s));
+            std::memcpy(&k, window + i % key_stream_alignment, sizeof(k));
+            s ^= k;
+            std::memcpy(dst + i, &s, sizeof(s));
+        }
+        for (; i < length; ++i)
+        {
+            dst[i] = src[i] ^ window[i % key_stream_alignment];
+        }
+    }
+
+private:
+    unsigned char m_pattern[2 * key_stream_alignment];
+    KeyStream m_stream;
+};
+
+/// <summary>
+/// Fixed 8-byte keys: the whole key is one 64-bit word, rotated once to the starting phase
+/// and broadcast, so the transform is a single 64-bit XOR per word (and per vector lane).
+/// Runs longer than fixed_key_inline_limit use a KeyStream, as for the other lengths.
+/// Relies on little-endian byte order, like the rest of this file.
+/// </summary>
+template <>
+class FixedKeyXor<8>
+{
+public:
+    explicit FixedKeyXor(std::string_view key)
+        : m_stream(key)
+    {
+        assert(key.length() == 8);
+        std::memcpy(&m_word, key.data(), sizeof(m_word));
+    }
+
+    const char* name() const { return "xor"; }
+
+    void apply(unsigned char* dst, const unsigned char* src, size_t length, uint64_t key_offset) const
+    {
+        if (length > fixed_key_inline_limit)
+        {
+            m_stream.apply(dst, src, length, key_offset);
+            return;
+        }
+
+        // Byte j of the rotated word is key[(key_offset + j) % 8]
+        const uint64_t word = std::rotr(m_word, static_cast<int>(8 * (key_offset % 8)));
+        size_t i = 0;
+#if defined(ENCRYPTION_X86) && defined(__AVX2__)
+        const __m256i k = _mm256_set1_epi64x(static_cast<long long>(word));
+        for (; i + 64 <= length; i += 64)
+        {
+            const __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            const __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(s0, k));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_xor_si256(s1, k));
+        }
+#elif defined(ENCRYPTION_X86)
+        const __m128i k = _mm_set1_epi64x(static_cast<long long>(word));
+        for (; i + 64 <= length; i += 64)
+        {
+            const __m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+            const __m128i s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32));
+            const __m128i s3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(s0, k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), _mm_xor_si128(s1, k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 32), _mm_xor_si128(s2, k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 48), _mm_xor_si128(s3, k));
+        }
+#endif
+        for (; i + 8 <= length; i += 8)
+        {
+            uint64_t s;
+            std::memcpy(&s, src + i, sizeof(s));
+            s ^= word;
+            std::memcpy(dst + i, &s, sizeof(s));
+        }
+        for (size_t j = 0; i < length; ++i, ++j)
+        {
+            dst[i] = src[i] ^ static_cast<unsigned char>(word >> (8 * j));
+        }
+    }
+
+private:
+    uint64_t m_word = 0;
+    KeyStream m_stream;
+};
+
+/// <summary>
+/// Encrypts or decrypts a buffer in place with a keyed cipher (for example an expanded
+/// KeyStream). Use this form when the same key is applied to many buffers.
+/// </summary>
+/// <param name="data">The bytes to transform; overwritten with the result</param>
+/// <param name="cipher">The keyed cipher</param>
+/// <param name="key_offset">Position of data[0] in the overall stream</param>
+template <StreamCipher Cipher>
+void encrypt_decrypt(std::span<unsigned char> data, const Cipher& cipher, uint64_t key_offset = 0)
+{
+    cipher.apply(data.data(), data.data(), data.size(), key_offset);
+}
+
+/// <summary>
+/// Encrypts or decrypts a buffer in place using XOR with the given key.
+/// Nothing is allocated, so callers that own their buffers can run it on every block
+/// of a stream without paying for a copy.
+/// </summary>
+/// <param name="data">The bytes to transform; overwritten with the result</param>
+/// <param name="key">The key used to encrypt or decrypt</param>
+/// <param name="key_offset">Position of data[0] in the overall stream. Passing the running
+/// byte count continues the key where the previous call stopped.</param>
+void encrypt_decrypt(std::span<unsigned char> data, std::string_view key, uint64_t key_offset = 0)
+{
+    assert(!key.empty());
+
+    xor_with_repeating_key(data.data(), data.data(), data.size(),
+                           reinterpret_cast<const unsigned char*>(key.data()), key.length(),
+                           static_cast<size_t>(key_offset % key.length()), active_xor_kernel().function);
+}
+
+/// <summary>
+/// Encrypts or decrypts a string using XOR with the given key.
+/// XOR is symmetric, so the same logic applies for both operations.
+/// The work is done by the fastest XOR kernel available on this CPU.
+/// </summary>
+/// <param name="source">The string to be transformed (either plaintext or ciphertext)</param>
+/// <param name="key">The key used to encrypt or decrypt</param>
+/// <returns>The resulting transformed string</returns>
+std::string encrypt_decrypt(const std::string& source, const std::string& key)
+{
+    const auto key_length = key.length();
+    const auto source_length = source.length();
+
+    // Ensure both key and source strings are not empty
+    assert(key_length > 0 && source_length > 0);
+
+    std::string output = source;
+
+    // Perform XOR operation between source characters and key (key repeats if shorter)
+    encrypt_decrypt(std::span<unsigned char>(reinterpret_cast<unsigned char*>(output.data()), source_length), key);
+
+    return output;
+}
+
+/// <summary>
+/// SHA-256 (FIPS 180-4). Used to derive fixed-size cipher keys from the passphrase.
+/// </summary>
+class Sha256
+{
+public:
+    using Digest = std::array<unsigned char, 32>;
+
+    Sha256() { reset(); }
+
+    void reset()
+    {
+        static const uint32_t initial_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        std::memcpy(m_state, initial_state, sizeof(m_state));
+        m_buffered = 0;
+        m_total_length = 0;
+    }
+
+    void update(const unsigned char* data, size_t length)
+    {
+        m_total_length += length;
+        if (m_buffered > 0)
+        {
+            const size_t take = std::min(length, sizeof(m_buffer) - m_buffered);
+            std::memcpy(m_buffer + m_buffered, data, take);
+            m_buffered += take;
+            data += take;
+            length -= take;
+            if (m_buffered < sizeof(m_buffer))
+            {
+                return;
+            }
+            compress(m_buffer);
+            m_buffered = 0;
+        }
+
+        for (; length >= sizeof(m_buffer); data += sizeof(m_buffer), length -= sizeof(m_buffer))
+        {
+            compress(data);
+        }
+
+        std::memcpy(m_buffer, data, length);
+        m_buffered = length;
+    }
+
+    Digest finish()
+    {
+        const uint64_t bit_length = m_total_length * 8;
+        const unsigned char padding_start = 0x80;
+        update(&padding_start, 1);
+
+        const unsigned char zeros[64] = {};
+        update(zeros, (m_buffered <= 56 ? 56 : 120) - m_buffered);
+
+        unsigned char length_bytes[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            length_bytes[i] = static_cast<unsigned char>(bit_length >> (56 - 8 * i));
+        }
+        update(length_bytes, sizeof(length_bytes));
+
+        Digest digest;
+        for (int i = 0; i < 8; ++i)
+        {
+            store_be32(digest.data() + 4 * i, m_state[i]);
+        }
+        reset();
+        return digest;
+    }
+
+    static Digest hash(const void* data, size_t length)
+    {
+        Sha256 state;
+        state.update(static_cast<const unsigned char*>(data), length);
+        return state.finish();
+    }
+
+private:
+    static uint32_t load_be32(const unsigned char* bytes)
+    {
+        return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+               (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+    }
+
+    static void store_be32(unsigned char* bytes, uint32_t value)
+    {
+        bytes[0] = static_cast<unsigned char>(value >> 24);
+        bytes[1] = static_cast<unsigned char>(value >> 16);
+        bytes[2] = static_cast<unsigned char>(value >> 8);
+        bytes[3] = static_cast<unsigned char>(value);
+    }
+
+    void compress(const unsigned char* block)
+    {
+        static const uint32_t round_constants[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        uint32_t schedule[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            schedule[i] = load_be32(block + 4 * i);
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            const uint32_t s0 = std::rotr(schedule[i - 15], 7) ^ std::rotr(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+            const uint32_t s1 = std::rotr(schedule[i - 2], 17) ^ std::rotr(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+            schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+        }
+
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            const uint32_t t1 = h + (std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                                round_constants[i] + schedule[i];
+            const uint32_t t2 = (std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+        m_state[5] += f;
+        m_state[6] += g;
+        m_state[7] += h;
+    }
+
+    uint32_t m_state[8];
+    unsigned char m_buffer[64];
+    size_t m_buffered = 0;
+    uint64_t m_total_length = 0;
+};
+
+/// <summary>
+/// HMAC-SHA256 (RFC 2104). The key's inner and outer padded blocks are hashed once, up
+/// front, so a tag costs only the hashing of the message and one extra block. The object
+/// is read-only after construction and may be shared by any number of threads.
+/// </summary>
+class HmacSha256
+{
+public:
+    HmacSha256(const unsigned char* key, size_t length)
+    {
+        unsigned char block[64] = {};
+        if (length > sizeof(block))
+        {
+            const Sha256::Digest digest = Sha256::hash(key, length);
+            std::copy(digest.begin(), digest.end(), block);
+        }
+        else
+        {
+            std::copy(key, key + length, block);
+        }
+
+        unsigned char pad[64];
+        for (size_t i = 0; i < sizeof(pad); ++i)
+        {
+            pad[i] = block[i] ^ 0x36;
+        }
+        m_inner.update(pad, sizeof(pad));
+        for (size_t i = 0; i < sizeof(pad); ++i)
+        {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        m_outer.update(pad, sizeof(pad));
+    }
+
+    /// <summary>
+    /// Returns a hash state to feed the message into; pass it to finish() for the tag.
+    /// </summary>
+    Sha256 begin() const { return m_inner; }
+
+    Sha256::Digest finish(Sha256& message) const
+    {
+        const Sha256::Digest inner = message.finish();
+        Sha256 outer = m_outer;
+        outer.update(inner.data(), inner.size());
+        return outer.finish();
+    }
+
+    /// <summary>
+    /// Compares two tags in time independent of where they first differ.
+    /// </summary>
+    static bool equal(const Sha256::Digest& a, const Sha256::Digest& b)
+    {
+        unsigned char difference = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            difference |= a[i] ^ b[i];
+        }
+        return difference == 0;
+    }
+
+private:
+    Sha256 m_inner;
+    Sha256 m_outer;
+};
+
+// LZ4 block format limits: matches are at least 4 bytes and reach back at most 64 KB, the
+// last 5 bytes of a block are always literals and the last match starts at least 12 bytes
+// before the end, so a decoder may copy in 8-byte steps without running past the output
+const size_t lz4_min_match = 4;
+const size_t lz4_max_offset = 65535;
+const size_t lz4_last_literals = 5;
+const size_t lz4_match_limit = 12;
+const int lz4_hash_log = 12;
+
+inline uint32_t lz4_read32(const unsigned char* bytes)
+{
+    uint32_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+inline uint64_t lz4_read64(const unsigned char* bytes)
+{
+    uint64_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Writes the bytes that extend a length field past its 4-bit token nibble
+inline unsigned char* lz4_write_length(unsigned char* out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = static_cast<unsigned char>(length);
+    return out;
+}
+
+/// <summary>
+/// Compresses src into dst in the LZ4 block format: a greedy single-pass matcher with a
+/// 4096-entry hash table of 4-byte sequences, as in LZ4's fast mode. On incompressible data
+/// the search steps further ahead the longer it goes without a match, so such data costs
+/// little time. Any LZ4 block decoder can read the output.
+/// </summary>
+/// <param name="capacity">Room in dst; compression stops as soon as the output would not fit</param>
+/// <returns>The compressed length, or 0 if it would exceed capacity</returns>
+size_t lz4_compress(const unsigned char* src, size_t length, unsigned char* dst, size_t capacity)
+{
+    uint32_t table[1u << lz4_hash_log] = {};
+    unsigned char* out = dst;
+    unsigned char* const out_end = dst + capacity;
+    size_t anchor = 0;
+
+    // Emits the literals [anchor, literal_end) followed by a match, or none when match_length is 0
+    const auto emit = [&](size_t literal_end, size_t match_length, size_t match_offset) {
+        const size_t literal_length = literal_end - anchor;
+        const size_t worst_case = 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1;
+        if (worst_case > static_cast<size_t>(out_end - out))
+        {
+            return false;
+        }
+
+        unsigned char* token = out++;
+        *token = static_cast<unsigned char>(std::min<size_t>(literal_length, 15) << 4);
+        if (literal_length >= 15)
+        {
+            out = lz4_write_length(out, literal_length - 15);
+        }
+        std::memcpy(out, src + anchor, literal_length);
+        out += literal_length;
+
+        if (match_length > 0)
+        {
+            *out++ = static_cast<unsigned char>(match_offset);
+            *out++ = static_cast<unsigned char>(match_offset >> 8);
+            const size_t extra = match_length - lz4_min_match;
+            *token |= static_cast<unsigned char>(std::min<size_t>(extra, 15));
+            if (extra >= 15)
+            {
+                out = lz4_write_length(out, extra - 15);
+            }
+        }
+        return true;
+    };
+
+    if (length > lz4_match_limit)
+    {
+        const size_t match_end_limit = length - lz4_last_literals;
+        size_t position = 0;
+        while (position + lz4_match_limit <= length)
+        {
+            const uint32_t sequence = lz4_read32(src + position);
+            const uint32_t hash = (sequence * 2654435761u) >> (32 - lz4_hash_log);
+            const size_t candidate = table[hash];
+            table[hash] = static_cast<uint32_t>(position);
+
+            if (candidate >= position || position - candidate > lz4_max_offset || lz4_read32(src + candidate) != sequence)
+            {
+                // Skip ahead faster the longer the current run of literals gets
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+
+            size_t end = position + lz4_min_match;
+            while (end + 8 <= match_end_limit)
+            {
+                const uint64_t difference = lz4_read64(src + end) ^ lz4_read64(src + end - (position - candidate));
+                if (difference != 0)
+                {
+                    end += static_cast<size_t>(std::countr_zero(difference)) / 8;
+                    break;
+                }
+                end += 8;
+            }
+            if (end + 8 > match_end_limit)
+            {
+                while (end < match_end_limit && src[end] == src[end - (position - candidate)])
+                {
+                    ++end;
+                }
+            }
+
+            if (!emit(position, end - position, position - candidate))
+            {
+                return 0;
+            }
+            position = end;
+            anchor = end;
+        }
+    }
+
+    if (!emit(length, 0, 0))
+    {
+        return 0;
+    }
+    return static_cast<size_t>(out - dst);
+}
+
+/// <summary>
+/// Decompresses an LZ4 block into exactly expected bytes. Every length and offset is checked
+/// against the input and output bounds, so corrupt or hostile input fails cleanly.
+/// </summary>
+/// <returns>True if the block was well formed and decoded to exactly expected bytes</returns>
+bool lz4_decompress(const unsigned char* src, size_t length, unsigned char* dst, size_t expected)
+{
+    size_t in = 0;
+    size_t out = 0;
+    const auto read_length = [&](size_t& value) {
+        for (;;)
+        {
+            if (in >= length)
+            {
+                return false;
+            }
+            const unsigned char extra = src[in++];
+            value += extra;
+            if (extra != 255)
+            {
+                return true;
+            }
+        }
+    };
+
+    for (;;)
+    {
+        if (in >= length)
+        {
+            return false;
+        }
+        const unsigned char token = src[in++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(literal_length))
+        {
+            return false;
+        }
+        if (literal_length > length - in || literal_length > expected - out)
+        {
+            return false;
+        }
+        // Short runs, the common case, are copied as one fixed 16-byte move where both sides have room
+        if (literal_length <= 16 && length - in >= 16 && expected - out >= 16)
+        {
+            std::memcpy(dst + out, src + in, 16);
+        }
+        else
+        {
+            std::memcpy(dst + out, src + in, literal_length);
+        }
+        in += literal_length;
+        out += literal_length;
+
+        // The last sequence is literals only
+        if (in == length)
+        {
+            return out == expected;
+        }
+
+        if (length - in < 2)
+        {
+            return false;
+        }
+        const size_t offset = src[in] | (static_cast<size_t>(src[in + 1]) << 8);
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(match_length))
+        {
+            return false;
+        }
+        match_length += lz4_min_match;
+        if (offset == 0 || offset > out || match_length > expected - out)
+        {
+            return false;
+        }
+
+        unsigned char* const target = dst + out;
+        const unsigned char* const source = target - offset;
+        if (offset >= 8 && expected - out >= match_length + 8)
+        {
+            // 8-byte steps may overshoot the match by up to 7 bytes, which the next sequence overwrites
+            for (size_t i = 0; i < match_length; i += 8)
+            {
+                std::memcpy(target + i, source + i, 8);
+            }
+        }
+        else if (offset >= match_length)
+        {
+            std::memcpy(target, source, match_length);
+        }
+        else
+        {
+            // Overlapping match: each byte may depend on one this copy just wrote
+            for (size_t i = 0; i < match_length; ++i)
+            {
+                target[i] = source[i];
+            }
+        }
+        out += match_length;
+    }
+}
+
+/// <summary>
+/// Signature of the ChaCha20 keystream generators: writes a fixed number of consecutive
+/// 64-byte blocks, starting at block index `block`, for the given initial state. Each
+/// generator writes as many as its entry in chacha_kernels says: 1 for scalar, 4 for SSE2
+/// and 8 for AVX2.
+/// </summary>
+using ChaChaBlocksFunction = void (*)(const uint32_t state[16], uint64_t block, unsigned char* out);
+
+/// <summary>
+/// Splits a 64-bit block index into the two counter words. The low word is the RFC 8439
+/// block counter; overflow carries into the first nonce word, which extends a single nonce
+/// past RFC 8439's 256 GB limit without changing any output below it.
+/// </summary>
+inline void chacha_counter_words(const uint32_t state[16], uint64_t block, uint32_t& word12, uint32_t& word13)
+{
+    word12 = static_cast<uint32_t>(block);
+    word13 = state[13] + static_cast<uint32_t>(block >> 32);
+}
+
+/// <summary>
+/// Portable ChaCha20 block function, one 64-byte block per call.
+/// </summary>
+void chacha20_blocks_scalar(const uint32_t state[16], uint64_t block, unsigned char* out)
+{
+    uint32_t input[16];
+    std::memcpy(input, state, sizeof(input));
+    chacha_counter_words(state, block, input[12], input[13]);
+
+    uint32_t x[16];
+    std::memcpy(x, input, sizeof(x));
+
+    const auto quarter_round = [&x](int a, int b, int c, int d) {
+        x[a] += x[b]; x[d] = std::rotl(x[d] ^ x[a], 16);
+        x[c] += x[d]; x[b] = std::rotl(x[b] ^ x[c], 12);
+        x[a] += x[b]; x[d] = std::rotl(x[d] ^ x[a], 8);
+        x[c] += x[d]; x[b] = std::rotl(x[b] ^ x[c], 7);
+    };
+
+    for (int round = 0; round < 10; ++round)
+    {
+        quarter_round(0, 4, 8, 12);
+        quarter_round(1, 5, 9, 13);
+        quarter_round(2, 6, 10, 14);
+        quarter_round(3, 7, 11, 15);
+        quarter_round(0, 5, 10, 15);
+        quarter_round(1, 6, 11, 12);
+        quarter_round(2, 7, 8, 13);
+        quarter_round(3, 4, 9, 14);
+    }
+
+    for (int i = 0; i < 16; ++i)
+    {
+        const uint32_t word = x[i] + input[i];
+        out[4 * i] = static_cast<unsigned char>(word);
+        out[4 * i + 1] = static_cast<unsigned char>(word >> 8);
+        out[4 * i + 2] = static_cast<unsigned char>(word >> 16);
+        out[4 * i + 3] = static_cast<unsigned char>(word >> 24);
+    }
+}
+
+#if defined(ENCRYPTION_X86)
+template <int bits>
+inline __m128i rotl_epi32(__m128i value)
+{
+    return _mm_or_si128(_mm_slli_epi32(value, bits), _mm_srli_epi32(value, 32 - bits));
+}
+
+/// <summary>
+/// SSE2 ChaCha20, four blocks per call. Register i holds state word i of all four blocks,
+/// so the rounds run on four blocks at once; the result is transposed back to block order.
+/// </summary>
+void chacha20_blocks_sse2(const uint32_t state[16], uint64_t block, unsigned char* out)
+{
+    __m128i input[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        input[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+    }
+    uint32_t low[4];
+    uint32_t high[4];
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        chacha_counter_words(state, block + lane, low[lane], high[lane]);
+    }
+    input[12] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low));
+    input[13] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high));
+
+    __m128i x[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        x[i] = input[i];
+    }
+
+    const auto quarter_round = [&x](int a, int b, int c, int d) {
+        x[a] = _mm_add_epi32(x[a], x[b]); x[d] = rotl_epi32<16>(_mm_xor_si128(x[d], x[a]));
+        x[c] = _mm_add_epi32(x[c], x[d]); x[b] = rotl_epi32<12>(_mm_xor_si128(x[b], x[c]));
+        x[a] = _mm_add_epi32(x[a], x[b]); x[d] = rotl_epi32<8>(_mm_xor_si128(x[d], x[a]));
+        x[c] = _mm_add_epi32(x[c], x[d]); x[b] = rotl_epi32<7>(_mm_xor_si128(x[b], x[c]));
+    };
+
+    for (int round = 0; round < 10; ++round)
+    {
+        quarter_round(0, 4, 8, 12);
+        quarter_round(1, 5, 9, 13);
+        quarter_round(2, 6, 10, 14);
+        quarter_round(3, 7, 11, 15);
+        quarter_round(0, 5, 10, 15);
+        quarter_round(1, 6, 11, 12);
+        quarter_round(2, 7, 8, 13);
+        quarter_round(3, 4, 9, 14);
+    }
+
+    for (int group = 0; group < 4; ++group)
+    {
+        const __m128i a = _mm_add_epi32(x[4 * group], input[4 * group]);
+        const __m128i b = _mm_add_epi32(x[4 * group + 1], input[4 * group + 1]);
+        const __m128i c = _mm_add_epi32(x[4 * group + 2], input[4 * group + 2]);
+        const __m128i d = _mm_add_epi32(x[4 * group + 3], input[4 * group + 3]);
+
+        // 4x4 transpose: afterwards row j holds words 4*group..4*group+3 of block j
+        const __m128i ab_low = _mm_unpacklo_epi32(a, b);
+        const __m128i cd_low = _mm_unpacklo_epi32(c, d);
+        const __m128i ab_high = _mm_unpackhi_epi32(a, b);
+        const __m128i cd_high = _mm_unpackhi_epi32(c, d);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 0 * 64 + 16 * group), _mm_unpacklo_epi64(ab_low, cd_low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 1 * 64 + 16 * group), _mm_unpackhi_epi64(ab_low, cd_low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * 64 + 16 * group), _mm_unpacklo_epi64(ab_high, cd_high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * 64 + 16 * group), _mm_unpackhi_epi64(ab_high, cd_high));
+    }
+}
+
+template <int bits>
+TARGET_AVX2 inline __m256i rotl_epi32(__m256i value)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(value, bits), _mm256_srli_epi32(value, 32 - bits));
+}
+
+/// <summary>
+/// AVX2 ChaCha20, eight blocks per call. Same layout as the SSE2 version with eight lanes;
+/// the 16- and 8-bit rotations are byte shuffles.
+/// </summary>
+TARGET_AVX2 void chacha20_blocks_avx2(const uint32_t state[16], uint64_t block, unsigned char* out)
+{
+    __m256i input[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        input[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+    }
+    uint32_t low[8];
+    uint32_t high[8];
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        chacha_counter_words(state, block + lane, low[lane], high[lane]);
+    }
+    input[12] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(low));
+    input[13] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(high));
+
+    __m256i x[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        x[i] = input[i];
+    }
+
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                              2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                             3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+    const auto quarter_round = [&](int a, int b, int c, int d) TARGET_AVX2 {
+        x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rotate16);
+        x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotl_epi32<12>(_mm256_xor_si256(x[b], x[c]));
+        x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rotate8);
+        x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotl_epi32<7>(_mm256_xor_si256(x[b], x[c]));
+    };
+
+    for (int round = 0; round < 10; ++round)
+    {
+        quarter_round(0, 4, 8, 12);
+        quarter_round(1, 5, 9, 13);
+        quarter_round(2, 6, 10, 14);
+        quarter_round(3, 7, 11, 15);
+        quarter_round(0, 5, 10, 15);
+        quarter_round(1, 6, 11, 12);
+        quarter_round(2, 7, 8, 13);
+        quarter_round(3, 4, 9, 14);
+    }
+
+    // Transpose within each 128-bit lane, as in the SSE2 version: rows[group][j] then holds
+    // words 4*group..4*group+3 of block j in its low lane and of block j+4 in its high lane
+    __m256i rows[4][4];
+    for (int group = 0; group < 4; ++group)
+    {
+        const __m256i a = _mm256_add_epi32(x[4 * group], input[4 * group]);
+        const __m256i b = _mm256_add_epi32(x[4 * group + 1], input[4 * group + 1]);
+        const __m256i c = _mm256_add_epi32(x[4 * group + 2], input[4 * group + 2]);
+        const __m256i d = _mm256_add_epi32(x[4 * group + 3], input[4 * group + 3]);
+        const __m256i ab_low = _mm256_unpacklo_epi32(a, b);
+        const __m256i cd_low = _mm256_unpacklo_epi32(c, d);
+        const __m256i ab_high = _mm256_unpackhi_epi32(a, b);
+        const __m256i cd_high = _mm256_unpackhi_epi32(c, d);
+        rows[group][0] = _mm256_unpacklo_epi64(ab_low, cd_low);
+        rows[group][1] = _mm256_unpackhi_epi64(ab_low, cd_low);
+        rows[group][2] = _mm256_unpacklo_epi64(ab_high, cd_high);
+        rows[group][3] = _mm256_unpackhi_epi64(ab_high, cd_high);
+    }
+
+    for (int j = 0; j < 4; ++j)
+    {
+        unsigned char* low_block = out + 64 * j;
+        unsigned char* high_block = out + 64 * (j + 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(low_block), _mm256_permute2x128_si256(rows[0][j], rows[1][j], 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(low_block + 32), _mm256_permute2x128_si256(rows[2][j], rows[3][j], 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(high_block), _mm256_permute2x128_si256(rows[0][j], rows[1][j], 0x31));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(high_block + 32), _mm256_permute2x128_si256(rows[2][j], rows[3][j], 0x31));
+    }
+}
+#endif
+
+/// <summary>
+/// A ChaCha20 keystream generator together with how many blocks it produces per call.
+/// </summary>
+struct ChaChaKernel
+{
+    const char* name;
+    size_t blocks;
+    ChaChaBlocksFunction function;
+    bool (*is_supported)();
+};
+
+// Largest number of blocks any ChaChaKernel produces per call
+const size_t chacha_max_blocks = 8;
+
+/// <summary>
+/// Every ChaCha20 generator compiled into this build, fastest first.
+/// </summary>
+const ChaChaKernel chacha_kernels[] = {
+#if defined(ENCRYPTION_X86)
+    { "avx2", 8, chacha20_blocks_avx2, cpu_has_avx2 },
+    { "sse2", 4, chacha20_blocks_sse2, always_supported },
+#endif
+    { "scalar", 1, chacha20_blocks_scalar, always_supported },
+};
+
+/// <summary>
+/// Returns the fastest ChaCha20 generator the running CPU supports.
+/// </summary>
+const ChaChaKernel& active_chacha_kernel()
+{
+    static const ChaChaKernel& selected = []() -> const ChaChaKernel& {
+        for (const ChaChaKernel& kernel : chacha_kernels)
+        {
+            if (kernel.is_supported())
+            {
+                return kernel;
+            }
+        }
+        return chacha_kernels[sizeof(chacha_kernels) / sizeof(chacha_kernels[0]) - 1];
+    }();
+    return selected;
+}
+
+/// <summary>
+/// ChaCha20 stream cipher (RFC 8439). The keystream block for any byte offset is computed
+/// directly from its block counter, so the cipher seeks in O(1) and every chunk of a
+/// parallel or streaming run can be processed independently, just like the XOR key phase.
+/// </summary>
+class ChaCha20Cipher
+{
+public:
+    using Key = std::array<unsigned char, 32>;
+    using Nonce = std::array<unsigned char, 12>;
+
+    ChaCha20Cipher(const Key& key, const Nonce& nonce, uint32_t initial_counter = 0,
+                   const ChaChaKernel& kernel = active_chacha_kernel())
+        : m_kernel(kernel),
+          m_initial_counter(initial_counter)
+    {
+        m_state[0] = 0x61707865;
+        m_state[1] = 0x3320646e;
+        m_state[2] = 0x79622d32;
+        m_state[3] = 0x6b206574;
+        for (int i = 0; i < 8; ++i)
+        {
+            m_state[4 + i] = load_le32(key.data() + 4 * i);
+        }
+        m_state[12] = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            m_state[13 + i] = load_le32(nonce.data() + 4 * i);
+        }
+    }
+
+    const char* name() const { return "chacha20"; }
+
+    void apply(unsigned char* dst, const unsigned char* src, size_t length, uint64_t offset) const
+    {
+        alignas(64) unsigned char keystream[chacha_max_blocks * 64];
+        const XorBlockFunction xor_block = active_xor_kernel().function;
+
+        uint64_t block = m_initial_counter + offset / 64;
+        size_t skip = static_cast<size_t>(offset % 64);
+
+        while (length > 0)
+        {
+            // Full batches go to the vector generator; the last few blocks are made one at a time
+            const size_t blocks_needed = (skip + length + 63) / 64;
+            size_t blocks = m_kernel.blocks;
+            if (blocks_needed >= blocks)
+            {
+                m_kernel.function(m_state, block, keystream);
+            }
+            else
+            {
+                blocks = blocks_needed;
+                for (size_t i = 0; i < blocks; ++i)
+                {
+                    chacha20_blocks_scalar(m_state, block + i, keystream + 64 * i);
+                }
+            }
+
+            const size_t run = std::min(length, blocks * 64 - skip);
+            xor_block(dst, src, keystream + skip, run);
+            dst += run;
+            src += run;
+            length -= run;
+            block += blocks;
+            skip = 0;
+        }
+    }
+
+private:
+    static uint32_t load_le32(const unsigned char* bytes)
+    {
+        return static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8) |
+               (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    }
+
+    const ChaChaKernel& m_kernel;
+    uint32_t m_state[16];
+    uint32_t m_initial_counter;
+};
+
+// AES-256 has 14 rounds and therefore 15 round keys
+const size_t aes256_rounds = 14;
+
+/// <summary>
+/// The AES S-box (FIPS 197, figure 7).
+/// </summary>
+const unsigned char aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/// <summary>
+/// Signature of the AES-CTR keystream generators: encrypts `blocks` consecutive counter
+/// blocks, the first being the 128-bit big-endian value counter_high:counter_low, into out.
+/// </summary>
+using AesCtrBlocksFunction = void (*)(const unsigned char* round_keys, uint64_t counter_high, uint64_t counter_low,
+                                      size_t blocks, unsigned char* out);
+
+inline unsigned char aes_xtime(unsigned char value)
+{
+    return static_cast<unsigned char>((value << 1) ^ ((value & 0x80) ? 0x1b : 0x00));
+}
+
+/// <summary>
+/// Portable byte-oriented AES-256 encryption of the counter blocks. It is a straight
+/// transcription of FIPS 197, kept for CPUs without AES-NI; its S-box lookups are not
+/// constant-time.
+/// </summary>
+void aes_ctr_blocks_portable(const unsigned char* round_keys, uint64_t counter_high, uint64_t counter_low,
+                             size_t blocks, unsigned char* out)
+{
+    for (size_t block = 0; block < blocks; ++block, out += 16)
+    {
+        const uint64_t low = counter_low + block;
+        const uint64_t high = counter_high + (low < counter_low ? 1 : 0);
+        unsigned char state[16];
+        for (int i = 0; i < 8; ++i)
+        {
+            state[i] = static_cast<unsigned char>(high >> (56 - 8 * i));
+            state[8 + i] = static_cast<unsigned char>(low >> (56 - 8 * i));
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            state[i] ^= round_keys[i];
+        }
+
+        for (size_t round = 1; round <= aes256_rounds; ++round)
+        {
+            // SubBytes and ShiftRows together; the state is column-major, byte 4*c+r = row r, column c
+            unsigned char shifted[16];
+            for (int column = 0; column < 4; ++column)
+            {
+                for (int row = 0; row < 4; ++row)
+                {
+                    shifted[4 * column + row] = aes_sbox[state[4 * ((column + row) % 4) + row]];
+                }
+            }
+
+            if (round != aes256_rounds)
+            {
+                for (int column = 0; column < 4; ++column)
+                {
+                    unsigned char* c = shifted + 4 * column;
+                    const unsigned char all = c[0] ^ c[1] ^ c[2] ^ c[3];
+                    const unsigned char first = c[0];
+                    c[0] ^= all ^ aes_xtime(c[0] ^ c[1]);
+                    c[1] ^= all ^ aes_xtime(c[1] ^ c[2]);
+                    c[2] ^= all ^ aes_xtime(c[2] ^ c[3]);
+                    c[3] ^= all ^ aes_xtime(c[3] ^ first);
+                }
+            }
+
+            for (int i = 0; i < 16; ++i)
+            {
+                state[i] = shifted[i] ^ round_keys[16 * round + i];
+            }
+        }
+
+        std::memcpy(out, state, sizeof(state));
+    }
+}
+
+#if defined(ENCRYPTION_X86)
+/// <summary>
+/// AES-NI counter-mode keystream. Eight counter blocks are encrypted together: each aesenc
+/// has a latency of several cycles but the CPU can start one per cycle, so interleaving
+/// eight independent blocks keeps the AES unit busy instead of waiting on each round.
+/// </summary>
+TARGET_AESNI void aes_ctr_blocks_aesni(const unsigned char* round_keys, uint64_t counter_high, uint64_t counter_low,
+                                       size_t blocks, unsigned char* out)
+{
+    __m128i keys[aes256_rounds + 1];
+    for (size_t i = 0; i <= aes256_rounds; ++i)
+    {
+        keys[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(round_keys + 16 * i));
+    }
+    // Counters are kept as native 64-bit halves and byte-reversed into big-endian blocks
+    const __m128i byte_swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    const auto counter_block = [&](size_t index) TARGET_AESNI {
+        const uint64_t low = counter_low + index;
+        const uint64_t high = counter_high + (low < counter_low ? 1 : 0);
+        const __m128i counter = _mm_set_epi64x(static_cast<long long>(high), static_cast<long long>(low));
+        return _mm_xor_si128(_mm_shuffle_epi8(counter, byte_swap), keys[0]);
+    };
+
+    size_t block = 0;
+    for (; block + 8 <= blocks; block += 8)
+    {
+        // Written out lane by lane so all eight blocks stay in registers across the rounds
+        __m128i b0 = counter_block(block), b1 = counter_block(block + 1);
+        __m128i b2 = counter_block(block + 2), b3 = counter_block(block + 3);
+        __m128i b4 = counter_block(block + 4), b5 = counter_block(block + 5);
+        __m128i b6 = counter_block(block + 6), b7 = counter_block(block + 7);
+        for (size_t round = 1; round < aes256_rounds; ++round)
+        {
+            const __m128i key = keys[round];
+            b0 = _mm_aesenc_si128(b0, key);
+            b1 = _mm_aesenc_si128(b1, key);
+            b2 = _mm_aesenc_si128(b2, key);
+            b3 = _mm_aesenc_si128(b3, key);
+            b4 = _mm_aesenc_si128(b4, key);
+            b5 = _mm_aesenc_si128(b5, key);
+            b6 = _mm_aesenc_si128(b6, key);
+            b7 = _mm_aesenc_si128(b7, key);
+        }
+        const __m128i last = keys[aes256_rounds];
+        auto* dst = reinterpret_cast<__m128i*>(out + 16 * block);
+        _mm_storeu_si128(dst, _mm_aesenclast_si128(b0, last));
+        _mm_storeu_si128(dst + 1, _mm_aesenclast_si128(b1, last));
+        _mm_storeu_si128(dst + 2, _mm_aesenclast_si128(b2, last));
+        _mm_storeu_si128(dst + 3, _mm_aesenclast_si128(b3, last));
+        _mm_storeu_si128(dst + 4, _mm_aesenclast_si128(b4, last));
+        _mm_storeu_si128(dst + 5, _mm_aesenclast_si128(b5, last));
+        _mm_storeu_si128(dst + 6, _mm_aesenclast_si128(b6, last));
+        _mm_storeu_si128(dst + 7, _mm_aesenclast_si128(b7, last));
+    }
+
+    for (; block < blocks; ++block)
+    {
+        __m128i b = counter_block(block);
+        for (size_t round = 1; round < aes256_rounds; ++round)
+        {
+            b = _mm_aesenc_si128(b, keys[round]);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * block), _mm_aesenclast_si128(b, keys[aes256_rounds]));
+    }
+}
+#endif
+
+/// <summary>
+/// An AES-CTR keystream generator with a CPU feature check.
+/// </summary>
+struct AesKernel
+{
+    const char* name;
+    AesCtrBlocksFunction function;
+    bool (*is_supported)();
+};
+
+/// <summary>
+/// Every AES-CTR generator compiled into this build, fastest first.
+/// </summary>
+const AesKernel aes_kernels[] = {
+#if defined(ENCRYPTION_X86)
+    { "aesni", aes_ctr_blocks_aesni, cpu_has_aesni },
+#endif
+    { "portable", aes_ctr_blocks_portable, always_supported },
+};
+
+/// <summary>
+/// Returns the fastest AES-CTR generator the running CPU supports.
+/// </summary>
+const AesKernel& active_aes_kernel()
+{
+    static const AesKernel& selected = []() -> const AesKernel& {
+        for (const AesKernel& kernel : aes_kernels)
+        {
+            if (kernel.is_supported())
+            {
+                return kernel;
+            }
+        }
+        return aes_kernels[sizeof(aes_kernels) / sizeof(aes_kernels[0]) - 1];
+    }();
+    return selected;
+}
+
+/// <summary>
+/// AES-256 in counter mode (NIST SP 800-38A). The counter block for byte offset n is the
+/// initial counter block plus n / 16, added as a 128-bit big-endian integer, so like
+/// ChaCha20 any chunk can be encrypted or decrypted without touching the ones before it.
+/// </summary>
+class AesCtrCipher
+{
+public:
+    using Key = std::array<unsigned char, 32>;
+    using CounterBlock = std::array<unsigned char, 16>;
+
+    AesCtrCipher(const Key& key, const CounterBlock& initial_counter, const AesKernel& kernel = active_aes_kernel())
+        : m_kernel(kernel)
+    {
+        expand_key(key);
+        for (int i = 0; i < 8; ++i)
+        {
+            m_counter_high = (m_counter_high << 8) | initial_counter[i];
+            m_counter_low = (m_counter_low << 8) | initial_counter[8 + i];
+        }
+    }
+
+    const char* name() const { return "aes256-ctr"; }
+
+    void apply(unsigned char* dst, const unsigned char* src, size_t length, uint64_t offset) const
+    {
+        // Keystream is generated a batch at a time so the XOR kernel runs over long spans
+        alignas(64) unsigned char keystream[1024];
+        const size_t batch_blocks = sizeof(keystream) / 16;
+        const XorBlockFunction xor_block = active_xor_kernel().function;
+
+        uint64_t block = offset / 16;
+        size_t skip = static_cast<size_t>(offset % 16);
+
+        while (length > 0)
+        {
+            const size_t blocks = std::min(batch_blocks, (skip + length + 15) / 16);
+            const uint64_t low = m_counter_low + block;
+            m_kernel.function(m_round_keys, m_counter_high + (low < m_counter_low ? 1 : 0), low, blocks, keystream);
+
+            const size_t run = std::min(length, blocks * 16 - skip);
+            xor_block(dst, src, keystream + skip, run);
+            dst += run;
+            src += run;
+            length -= run;
+            block += blocks;
+            skip = 0;
+        }
+    }
+
+private:
+    // FIPS 197 section 5.2 key expansion for Nk = 8
+    void expand_key(const Key& key)
+    {
+        std::memcpy(m_round_keys, key.data(), key.size());
+        unsigned char round_constant = 0x01;
+        for (size_t i = key.size(); i < sizeof(m_round_keys); i += 4)
+        {
+            unsigned char word[4];
+            std::memcpy(word, m_round_keys + i - 4, sizeof(word));
+            if (i % 32 == 0)
+            {
+                const unsigned char first = word[0];
+                word[0] = static_cast<unsigned char>(aes_sbox[word[1]] ^ round_constant);
+                word[1] = aes_sbox[word[2]];
+                word[2] = aes_sbox[word[3]];
+                word[3] = aes_sbox[first];
+                round_constant = aes_xtime(round_constant);
+            }
+            else if (i % 32 == 16)
+            {
+                for (unsigned char& byte : word)
+                {
+                    byte = aes_sbox[byte];
+                }
+            }
+            for (int j = 0; j < 4; ++j)
+            {
+                m_round_keys[i + j] = static_cast<unsigned char>(m_round_keys[i + j - 32] ^ word[j]);
+            }
+        }
+    }
+
+    const AesKernel& m_kernel;
+    unsigned char m_round_keys[16 * (aes256_rounds + 1)];
+    uint64_t m_counter_high = 0;
+    uint64_t m_counter_low = 0;
+};
+
+// Work is handed to threads in chunks of this size: large enough to amortize the hand-off,
+// small enough that a chunk's source and destination stay in a core's L2 cache
+const size_t default_parallel_chunk_size = 256u << 10;
+
+/// <summary>
+/// Returns the number of hardware threads, or 1 if the platform cannot tell.
+/// </summary>
+unsigned default_thread_count()
+{
+    const unsigned count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+/// <summary>
+/// Applies a stream cipher across several threads. Each byte depends only on its own
+/// position, so the buffer is cut into chunks and every chunk is seeked to its own offset:
+/// the key phase for the XOR cipher, the block counter for ChaCha20 and AES-CTR.
+/// Worker threads are started once and reused for every call, so the engine is cheap
+/// enough to drive chunk by chunk from the streaming and mmap modes.
+/// The calling thread works alongside the pool and transform() returns when all chunks are done.
+/// The cipher is keyed (for XOR, expanded into a KeyStream) once, before the engine is created,
+/// and held by value, so each chunk is a direct call into the concrete cipher. Jobs reach the
+/// workers as a pointer to the caller's task and a function pointer instantiated for its
+/// type, so a call costs one indirect call per chunk and no allocation.
+/// An engine with a single thread keeps no per-call state, so one instance may be shared
+/// by any number of threads.
+/// </summary>
+template <StreamCipher Cipher>
+class ParallelCipherEngine
+{
+public:
+    ParallelCipherEngine(Cipher cipher, unsigned thread_count, size_t chunk_size = default_parallel_chunk_size)
+        : m_cipher(std::move(cipher)),
+          m_chunk_size(chunk_size)
+    {
+        assert(thread_count > 0 && chunk_size > 0);
+        for (unsigned i = 1; i < thread_count; ++i)
+        {
+            m_workers.emplace_back(&ParallelCipherEngine::worker_loop, this);
+        }
+    }
+
+    ~ParallelCipherEngine()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_work_ready.notify_all();
+        for (std::thread& worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    ParallelCipherEngine(const ParallelCipherEngine&) = delete;
+    ParallelCipherEngine& operator=(const ParallelCipherEngine&) = delete;
+
+    unsigned thread_count() const { return static_cast<unsigned>(m_workers.size()) + 1; }
+    const Cipher& cipher() const { return m_cipher; }
+
+    /// <summary>
+    /// Transforms length bytes of src into dst (which may alias src). key_offset is the position
+    /// of src[0] in the overall stream, so consecutive calls continue the keystream where the
+    /// last one stopped.
+    /// </summary>
+    void transform(unsigned char* dst, const unsigned char* src, size_t length, uint64_t key_offset)
+    {
+        const size_t chunk_count = (length + m_chunk_size - 1) / m_chunk_size;
+        if (m_workers.empty() || chunk_count < 2)
+        {
+            m_cipher.apply(dst, src, length, key_offset);
+            return;
+        }
+
+        parallel_for(chunk_count, [&](size_t chunk) {
+            const size_t begin = chunk * m_chunk_size;
+            m_cipher.apply(dst + begin, src + begin, std::min(m_chunk_size, length - begin), key_offset + begin);
+        });
+    }
+
+    /// <summary>
+    /// Calls task(i) for every i below count on the engine's threads, the calling thread
+    /// included, and returns when every call has finished. For per-chunk work that goes with
+    /// the transform, such as authentication tags, so it runs on the same threads.
+    /// </summary>
+    template <typename Task>
+    void parallel_for(size_t count, Task&& task)
+    {
+        if (m_workers.empty() || count < 2)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                task(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = const_cast<void*>(static_cast<const void*>(std::addressof(task)));
+            m_run_task = [](void* task, size_t index) {
+                (*static_cast<std::remove_reference_t<Task>*>(task))(index);
+            };
+            m_task_count = count;
+            m_next_task.store(0, std::memory_order_relaxed);
+            m_busy_workers = m_workers.size();
+            ++m_generation;
+        }
+        m_work_ready.notify_all();
+
+        process_tasks();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_done.wait(lock, [this] { return m_busy_workers == 0; });
+    }
+
+private:
+    // Claims indices of the current job until none are left
+    void process_tasks()
+    {
+        for (;;)
+        {
+            const size_t index = m_next_task.fetch_add(1, std::memory_order_relaxed);
+            if (index >= m_task_count)
+            {
+                return;
+            }
+            m_run_task(m_task, index);
+        }
+    }
+
+    void worker_loop()
+    {
+        uint64_t seen_generation = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_work_ready.wait(lock, [&] { return m_stopping || m_generation != seen_generation; });
+                if (m_stopping)
+                {
+                    return;
+                }
+                seen_generation = m_generation;
+            }
+
+            process_tasks();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busy_workers == 0)
+            {
+                m_work_done.notify_one();
+            }
+        }
+    }
+
+    const Cipher m_cipher;
+    const size_t m_chunk_size;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_ready;
+    std::condition_variable m_work_done;
+    uint64_t m_generation = 0;
+    size_t m_busy_workers = 0;
+    bool m_stopping = false;
+
+    // The job currently being processed; written under m_mutex before the generation changes
+    void* m_task = nullptr;
+    void (*m_run_task)(void* task, size_t index) = nullptr;
+    size_t m_task_count = 0;
+    std::atomic<size_t> m_next_task{ 0 };
+};
+
+/// <summary>
+/// Streaming XXH64 hash. Used as a fast running checksum over data that is too large to
+/// hold in memory; it detects corruption, it is not a cryptographic MAC.
+/// Input words are read in little-endian order, as on every platform this project targets.
+/// </summary>
+class Xxh64
+{
+public:
+    explicit Xxh64(uint64_t seed = 0)
+        : m_accumulators{ seed + prime1 + prime2, seed + prime2, seed, seed - prime1 },
+          m_seed(seed)
+    {
+    }
+
+    void update(const unsigned char* data, size_t length)
+    {
+        m_total_length += length;
+
+        // Top up a partial stripe left over from the previous call
+        if (m_buffered > 0)
+        {
+            const size_t take = std::min(length, sizeof(m_buffer) - m_buffered);
+            std::memcpy(m_buffer + m_buffered, data, take);
+            m_buffered += take;
+            data += take;
+            length -= take;
+            if (m_buffered < sizeof(m_buffer))
+            {
+                return;
+            }
+            consume_stripe(m_buffer);
+            m_buffered = 0;
+        }
+
+        for (; length >= sizeof(m_buffer); data += sizeof(m_buffer), length -= sizeof(m_buffer))
+        {
+            consume_stripe(data);
+        }
+
+        std::memcpy(m_buffer, data, length);
+        m_buffered = length;
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t hash;
+        if (m_total_length >= sizeof(m_buffer))
+        {
+            hash = std::rotl(m_accumulators[0], 1) + std::rotl(m_accumulators[1], 7) +
+                   std::rotl(m_accumulators[2], 12) + std::rotl(m_accumulators[3], 18);
+            for (uint64_t accumulator : m_accumulators)
+            {
+                hash = (hash ^ round(0, accumulator)) * prime1 + prime4;
+            }
+        }
+        else
+        {
+            hash = m_seed + prime5;
+        }
+        hash += m_total_length;
+
+        size_t i = 0;
+        for (; i + 8 <= m_buffered; i += 8)
+        {
+            hash ^= round(0, read64(m_buffer + i));
+            hash = std::rotl(hash, 27) * prime1 + prime4;
+        }
+        if (i + 4 <= m_buffered)
+        {
+            uint32_t word;
+            std::memcpy(&word, m_buffer + i, sizeof(word));
+            hash ^= static_cast<uint64_t>(word) * prime1;
+            hash = std::rotl(hash, 23) * prime2 + prime3;
+            i += 4;
+        }
+        for (; i < m_buffered; ++i)
+        {
+            hash ^= m_buffer[i] * prime5;
+            hash = std::rotl(hash, 11) * prime1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= prime2;
+        hash ^= hash >> 29;
+        hash *= prime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    /// <summary>
+    /// Hashes one buffer in a single call.
+    /// </summary>
+    static uint64_t hash(const unsigned char* data, size_t length, uint64_t seed = 0)
+    {
+        Xxh64 state(seed);
+        state.update(data, length);
+        return state.digest();
+    }
+
+private:
+    static constexpr uint64_t prime1 = 11400714785074694791ull;
+    static constexpr uint64_t prime2 = 14029467366897019727ull;
+    static constexpr uint64_t prime3 = 1609587929392839161ull;
+    static constexpr uint64_t prime4 = 9650029242287828579ull;
+    static constexpr uint64_t prime5 = 2870177450012600261ull;
+
+    static uint64_t read64(const unsigned char* bytes)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        return word;
+    }
+
+    static uint64_t round(uint64_t accumulator, uint64_t input)
+    {
+        accumulator += input * prime2;
+        return std::rotl(accumulator, 31) * prime1;
+    }
+
+    void consume_stripe(const unsigned char* stripe)
+    {
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            m_accumulators[lane] = round(m_accumulators[lane], read64(stripe + 8 * lane));
+        }
+    }
+
+    uint64_t m_accumulators[4];
+    uint64_t m_seed;
+    uint64_t m_total_length = 0;
+    unsigned char m_buffer[32] = {};
+    size_t m_buffered = 0;
+};
+
+/// <summary>
+/// Thread pool where every worker owns a task deque. A worker takes its newest task first
+/// (good locality for tasks it just spawned) and, when its own deque is empty, steals the
+/// oldest task from another worker. Tasks may submit further tasks; wait_idle() returns once
+/// every task, including those spawned along the way, has finished.
+/// </summary>
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(unsigned thread_count)
+    {
+        assert(thread_count > 0);
+        for (unsigned i = 0; i < thread_count; ++i)
+        {
+            m_queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (unsigned i = 0; i < thread_count; ++i)
+        {
+            m_threads.emplace_back(&WorkStealingPool::worker_loop, this, static_cast<size_t>(i));
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /// <summary>
+    /// Queues a task. Called from a worker it goes on that worker's own deque; otherwise the
+    /// deques are filled round-robin.
+    /// </summary>
+    void submit(std::function<void()> task)
+    {
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+
+        const size_t index = t_current_pool == this ? t_worker_index : m_next_queue.fetch_add(1) % m_queues.size();
+        {
+            std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+            m_queues[index]->tasks.push_back(std::move(task));
+        }
+
+        // Counted under the sleep mutex so a worker about to sleep cannot miss it
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            ++m_queued;
+        }
+        m_wake.notify_one();
+    }
+
+    /// <summary>
+    /// Blocks until no task is queued or running.
+    /// </summary>
+    void wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(m_idle_mutex);
+        m_idle.wait(lock, [this] { return m_pending.load() == 0; });
+    }
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool try_take(size_t self, std::function<void()>& task)
+    {
+        for (size_t k = 0; k < m_queues.size(); ++k)
+        {
+            const size_t victim = (self + k) % m_queues.size();
+            WorkerQueue& queue = *m_queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+            {
+                continue;
+            }
+
+            // Newest from our own deque, oldest from anyone else's
+            if (victim == self)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            m_queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(size_t self)
+    {
+        t_current_pool = this;
+        t_worker_index = self;
+
+        for (;;)
+        {
+            std::function<void()> task;
+            if (try_take(self, task))
+            {
+                task();
+                if (m_pending.fetch_sub(1) == 1)
+                {
+                    std::lock_guard<std::mutex> lock(m_idle_mutex);
+                    m_idle.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_wake.wait(lock, [this] { return m_stopping || m_queued.load() > 0; });
+            if (m_stopping && m_queued.load() == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    static thread_local WorkStealingPool* t_current_pool;
+    static thread_local size_t t_worker_index;
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_next_queue{ 0 };
+    std::atomic<size_t> m_queued{ 0 };
+    std::atomic<size_t> m_pending{ 0 };
+
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_wake;
+    bool m_stopping = false;
+
+    std::mutex m_idle_mutex;
+    std::condition_variable m_idle;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::t_current_pool = nullptr;
+thread_local size_t WorkStealingPool::t_worker_index = 0;
+
+/// <summary>
+/// Checks FixedKeyXor for one key length against encrypt_decrypt_reference, with the data split
+/// at odd points so the starting key phase varies from call to call.
+/// </summary>
+template <size_t KeyLength>
+bool check_fixed_key_xor(const std::string& data, const std::string& key_material)
+{
+    const std::string key = key_material.substr(0, KeyLength);
+    const FixedKeyXor<KeyLength> cipher(key);
+    std::string actual = data;
+    const std::span<unsigned char> bytes(reinterpret_cast<unsigned char*>(actual.data()), actual.size());
+    for (size_t position = 0, step = 1; position < bytes.size(); position += step, step = step * 3 + 1)
+    {
+        encrypt_decrypt(bytes.subspan(position, std::min(step, bytes.size() - position)), cipher, position);
+    }
+    if (actual != encrypt_decrypt_reference(data, key))
+    {
+        std::cerr << "Fixed-length key mismatch: key_length=" << KeyLength << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Checks every kernel the CPU supports against encrypt_decrypt_reference, byte for byte,
+/// over a spread of lengths, key lengths, key offsets and buffer misalignments.
+/// </summary>
+/// <returns>True if every supported kernel matched the reference</returns>
+bool run_self_test()
+{
+    const size_t lengths[] = { 1, 7, 15, 16, 17, 63, 64, 65, 255, 256, 257, 1000, 4099, 70001 };
+    const size_t key_lengths[] = { 1, 3, 7, 8, 16, 33, 64, 1023, 1024, 1500, 4093, 4096, 8191 };
+    const size_t key_offsets[] = { 0, 1, 5, 4095, 1000003 };
+
+    std::string data(70001 + 64, '\0');
+    std::string key_material(8192, '\0');
+    uint32_t seed = 0x12345678u;
+    for (auto& c : data)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        c = static_cast<char>(seed >> 24);
+    }
+    for (auto& c : key_material)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        c = static_cast<char>(seed >> 24);
+    }
+
+    bool all_passed = true;
+    std::cout << "Selected XOR kernel: " << active_xor_kernel().name << "\n";
+
+    for (const XorKernel& kernel : xor_kernels)
+    {
+        if (!kernel.is_supported())
+        {
+            std::cout << "  " << std::left << std::setw(8) << kernel.name << " skipped (not supported by this CPU)\n";
+            continue;
+        }
+
+        bool kernel_passed = true;
+        for (size_t length : lengths)
+        {
+            for (size_t key_length : key_lengths)
+            {
+                const std::string key = key_material.substr(0, key_length);
+                for (size_t key_offset : key_offsets)
+                {
+                    for (size_t misalignment = 0; misalignment < 4; ++misalignment)
+                    {
+                        // Rotating the key by the offset gives the reference the same starting phase
+                        const size_t shift = key_offset % key_length;
+                        const std::string rotated = key.substr(shift) + key.substr(0, shift);
+                        const std::string source = data.substr(misalignment, length);
+                        const std::string expected = encrypt_decrypt_reference(source, rotated);
+
+                        std::string actual(length + misalignment, '\0');
+                        xor_with_repeating_key(reinterpret_cast<unsigned char*>(&actual[misalignment]),
+                                               reinterpret_cast<const unsigned char*>(source.data()), length,
+                                               reinterpret_cast<const unsigned char*>(key.data()), key_length,
+                                               key_offset, kernel.function);
+
+                        std::string expanded(length + misalignment, '\0');
+                        const KeyStream key_stream(key, kernel.function);
+                        key_stream.apply(reinterpret_cast<unsigned char*>(&expanded[misalignment]),
+                                         reinterpret_cast<const unsigned char*>(source.data()), length, key_offset);
+
+                        if (actual.compare(misalignment, length, expected) != 0 ||
+                            expanded.compare(misalignment, length, expected) != 0)
+                        {
+                            std::cerr << "Kernel " << kernel.name << " mismatch: length=" << length
+                                      << " key_length=" << key_length << " key_offset=" << key_offset
+                                      << " misalignment=" << misalignment << std::endl;
+                            kernel_passed = false;
+                        }
+                    }
+                }
+            }
+        }
+
+        std::cout << "  " << std::left << std::setw(8) << kernel.name << (kernel_passed ? " passed" : " FAILED") << "\n";
+        all_passed = all_passed && kernel_passed;
+    }
+
+    // The in-place API must continue the key across calls that split the data unevenly
+    bool span_passed = true;
+    for (size_t key_length : key_lengths)
+    {
+        const std::string key = key_material.substr(0, key_length);
+        std::string actual = data;
+        const std::span<unsigned char> bytes(reinterpret_cast<unsigned char*>(actual.data()), actual.size());
+        size_t position = 0;
+        for (size_t step = 1; position < bytes.size(); step = step * 3 + 1)
+        {
+            const size_t length = std::min(step, bytes.size() - position);
+            encrypt_decrypt(bytes.subspan(position, length), key, position);
+            position += length;
+        }
+        if (actual != encrypt_decrypt_reference(data, key))
+        {
+            std::cerr << "In-place API mismatch: key_length=" << key_length << std::endl;
+            span_passed = false;
+        }
+    }
+    std::cout << "  " << std::left << std::setw(8) << "span" << (span_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && span_passed;
+
+    // Small chunks force many chunk boundaries, each of which must pick up the right key phase
+    bool parallel_passed = true;
+    for (unsigned threads : { 1u, 2u, 4u, 7u })
+    {
+        for (size_t key_length : key_lengths)
+        {
+            const std::string key = key_material.substr(0, key_length);
+            const std::string expected = encrypt_decrypt_reference(data, key);
+            std::string actual = data;
+            ParallelCipherEngine engine(KeyStream(key), threads, 1000);
+            auto* bytes = reinterpret_cast<unsigned char*>(&actual[0]);
+            engine.transform(bytes, bytes, actual.size() / 2, 0);
+            engine.transform(bytes + actual.size() / 2, bytes + actual.size() / 2, actual.size() - actual.size() / 2, actual.size() / 2);
+            if (actual != expected)
+            {
+                std::cerr << "Parallel engine mismatch: threads=" << threads << " key_length=" << key_length << std::endl;
+                parallel_passed = false;
+            }
+        }
+    }
+    std::cout << "  " << std::left << std::setw(8) << "parallel" << (parallel_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && parallel_passed;
+
+    const bool fixed_passed = check_fixed_key_xor<1>(data, key_material) & check_fixed_key_xor<2>(data, key_material) &
+                              check_fixed_key_xor<4>(data, key_material) & check_fixed_key_xor<8>(data, key_material) &
+                              check_fixed_key_xor<16>(data, key_material) & check_fixed_key_xor<32>(data, key_material) &
+                              check_fixed_key_xor<64>(data, key_material);
+    std::cout << "  " << std::left << std::setw(8) << "fixed" << (fixed_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && fixed_passed;
+
+    // Published XXH64 values, plus a streamed hash fed in odd-sized pieces against the one-shot hash
+    const auto* data_bytes = reinterpret_cast<const unsigned char*>(data.data());
+    Xxh64 streamed;
+    for (size_t position = 0, step = 1; position < data.size(); position += step, step = step * 2 + 1)
+    {
+        streamed.update(data_bytes + position, std::min(step, data.size() - position));
+    }
+    const bool checksum_passed = Xxh64::hash(nullptr, 0) == 0xEF46DB3751D8E999ull &&
+                                 Xxh64::hash(reinterpret_cast<const unsigned char*>("a"), 1) == 0xD24EC4F1A98C6E5Bull &&
+                                 streamed.digest() == Xxh64::hash(data_bytes, data.size());
+    std::cout << "  " << std::left << std::setw(8) << "xxh64" << (checksum_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && checksum_passed;
+
+    // FIPS 180-2 "abc" vector, plus a streamed digest fed in odd-sized pieces against the one-shot digest
+    const Sha256::Digest abc_expected = { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+                                          0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+    Sha256 streamed_sha;
+    for (size_t position = 0, step = 1; position < data.size(); position += step, step = step * 2 + 1)
+    {
+        streamed_sha.update(data_bytes + position, std::min(step, data.size() - position));
+    }
+    const bool sha_passed = Sha256::hash("abc", 3) == abc_expected &&
+                            streamed_sha.finish() == Sha256::hash(data_bytes, data.size());
+    std::cout << "  " << std::left << std::setw(8) << "sha256" << (sha_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && sha_passed;
+
+    // RFC 4231 test cases 2 (short key) and 6 (key longer than a block, hashed first)
+    const Sha256::Digest hmac_expected_2 = { 0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+                                             0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43 };
+    const Sha256::Digest hmac_expected_6 = { 0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+                                             0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54 };
+    const std::string hmac_message_2 = "what do ya want for nothing?";
+    const std::string hmac_message_6 = "Test Using Larger Than Block-Size Key - Hash Key First";
+    const std::vector<unsigned char> hmac_key_6(131, 0xaa);
+    const HmacSha256 hmac_2(reinterpret_cast<const unsigned char*>("Jefe"), 4);
+    const HmacSha256 hmac_6(hmac_key_6.data(), hmac_key_6.size());
+    Sha256 hmac_state_2 = hmac_2.begin();
+    hmac_state_2.update(reinterpret_cast<const unsigned char*>(hmac_message_2.data()), hmac_message_2.size());
+    Sha256 hmac_state_6 = hmac_6.begin();
+    hmac_state_6.update(reinterpret_cast<const unsigned char*>(hmac_message_6.data()), hmac_message_6.size());
+    const bool hmac_passed = HmacSha256::equal(hmac_2.finish(hmac_state_2), hmac_expected_2) &&
+                             HmacSha256::equal(hmac_6.finish(hmac_state_6), hmac_expected_6);
+    std::cout << "  " << std::left << std::setw(8) << "hmac" << (hmac_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && hmac_passed;
+
+    // A hand-made block with an overlapping match, then round trips of short, repetitive,
+    // incompressible and mixed inputs, and truncated blocks that must be rejected
+    const unsigned char lz4_block[] = { 0x36, 'a', 'b', 'c', 0x03, 0x00, 0x50, 'x', 'y', 'z', '1', '2' };
+    const std::string lz4_expected = "abcabcabcabcaxyz12";
+    std::string lz4_decoded(lz4_expected.size(), '\0');
+    bool lz4_passed = lz4_decompress(lz4_block, sizeof(lz4_block), reinterpret_cast<unsigned char*>(&lz4_decoded[0]),
+                                     lz4_decoded.size()) && lz4_decoded == lz4_expected;
+    std::vector<std::vector<unsigned char>> lz4_inputs = { {}, { 'a' }, std::vector<unsigned char>(12, 'a'),
+                                                           std::vector<unsigned char>(13, 'a'),
+                                                           std::vector<unsigned char>(1 << 20, 0) };
+    lz4_inputs.emplace_back(data_bytes, data_bytes + data.size());
+    std::vector<unsigned char> lz4_text;
+    for (int line = 0; lz4_text.size() < (300u << 10); ++line)
+    {
+        const std::string text = "2024-05-0" + std::to_string(line % 9) + " INFO request " + std::to_string(line * 7919) +
+                                 " served in " + std::to_string(line % 97) + " ms\n";
+        lz4_text.insert(lz4_text.end(), text.begin(), text.end());
+    }
+    lz4_inputs.push_back(lz4_text);
+    lz4_inputs.push_back(lz4_text);
+    lz4_inputs.back().insert(lz4_inputs.back().begin() + 1000, data_bytes, data_bytes + data.size());
+    for (const std::vector<unsigned char>& input : lz4_inputs)
+    {
+        std::vector<unsigned char> packed(input.size() + input.size() / 255 + 16);
+        const size_t packed_length = lz4_compress(input.data(), input.size(), packed.data(), packed.size());
+        std::vector<unsigned char> unpacked(input.size());
+        lz4_passed = lz4_passed && packed_length > 0 &&
+                     lz4_decompress(packed.data(), packed_length, unpacked.data(), unpacked.size()) && unpacked == input &&
+                     (input.size() < 2 || !lz4_decompress(packed.data(), packed_length - 1, unpacked.data(), unpacked.size()));
+    }
+    // The test data is random, so it must not fit in less than its own size
+    lz4_passed = lz4_passed && lz4_compress(data_bytes, data.size(), std::vector<unsigned char>(data.size()).data(),
+                                            data.size() - 1) == 0;
+    std::cout << "  " << std::left << std::setw(8) << "lz4" << (lz4_passed ? " passed" : " FAILED") << "\n";
+    all_passed = all_passed && lz4_passed;
+
+    // RFC 8439 section 2.3.2 block vector; then every generator against the scalar one, with
+    // data split at odd offsets and a start just below 2^32 blocks so the counter carries
+    std::cout << "Selected ChaCha20 kernel: " << active_chacha_kernel().name << "\n";
+    ChaCha20Cipher::Key chacha_key;
+    for (size_t i = 0; i < chacha_key.size(); ++i)
+    {
+        chacha_key[i] = static_cast<unsigned char>(i);
+    }
+    const ChaCha20Cipher::Nonce chacha_nonce = { 0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+    const unsigned char rfc_block[64] = {
+        0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+        0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+        0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+        0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e
+    };
+    const ChaChaKernel& scalar_chacha = chacha_kernels[sizeof(chacha_kernels) / sizeof(chacha_kernels[0]) - 1];
+    const ChaCha20Cipher reference_cipher(chacha_key, chacha_nonce, 0, scalar_chacha);
+    const uint64_t chacha_offsets[] = { 0, 100, (uint64_t(1) << 38) - 1000 };
+
+    for (const ChaChaKernel& kernel : chacha_kernels)
+    {
+        if (!kernel.is_supported())
+        {
+            std::cout << "  " << std::left << std::setw(8) << kernel.name << " skipped (not supported by this CPU)\n";
+            continue;
+        }
+
+        const ChaCha20Cipher cipher(chacha_key, chacha_nonce, 0, kernel);
+        unsigned char block[64] = {};
+        ChaCha20Cipher(chacha_key, chacha_nonce, 1, kernel).apply(block, block, sizeof(block), 0);
+        bool kernel_passed = std::memcmp(block, rfc_block, sizeof(block)) == 0;
+
+        for (uint64_t offset : chacha_offsets)
+        {
+            std::string expected = data;
+            auto* expected_bytes = reinterpret_cast<unsigned char*>(&expected[0]);
+            reference_cipher.apply(expected_bytes, expected_bytes, expected.size(), offset);
+
+            std::string actual = data;
+            auto* actual_bytes = reinterpret_cast<unsigned char*>(&actual[0]);
+            for (size_t position = 0, step = 1; position < actual.size(); position += step, step = step * 3 + 1)
+            {
+                const size_t length = std::min(step, actual.size() - position);
+                cipher.apply(actual_bytes + position, actual_bytes + position, length, offset + position);
+            }
+            if (actual != expected)
+            {
+                std::cerr << "ChaCha20 mismatch: kernel=" << kernel.name << " offset=" << offset << std::endl;
+                kernel_passed = false;
+            }
+        }
+
+        std::cout << "  " << std::left << std::setw(8) << kernel.name << (kernel_passed ? " passed" : " FAILED") << "\n";
+        all_passed = all_passed && kernel_passed;
+    }
+
+    // FIPS 197 appendix C.3 and the first blocks of SP 800-38A F.5.5 (CTR-AES256); then each
+    // generator against the portable one, at odd split points and across a 64-bit counter carry
+    std::cout << "Selected AES kernel: " << active_aes_kernel().name << "\n";
+    AesCtrCipher::Key fips_key;
+    AesCtrCipher::CounterBlock fips_block;
+    for (size_t i = 0; i < fips_key.size(); ++i)
+    {
+        fips_key[i] = static_cast<unsigned char>(i);
+    }
+    for (size_t i = 0; i < fips_block.size(); ++i)
+    {
+        fips_block[i] = static_cast<unsigned char>(i * 0x11);
+    }
+    const unsigned char fips_expected[16] = { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+                                              0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+    const AesCtrCipher::Key ctr_key = { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+                                        0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+    const AesCtrCipher::CounterBlock ctr_counter = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+                                                     0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+    const unsigned char ctr_plaintext[32] = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                                              0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+    const unsigned char ctr_expected[32] = { 0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+                                             0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a, 0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5 };
+    const AesCtrCipher::CounterBlock carry_counter = { 0, 0, 0, 0, 0, 0, 0, 1, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 };
+    const AesKernel& portable_aes = aes_kernels[sizeof(aes_kernels) / sizeof(aes_kernels[0]) - 1];
+    const AesCtrCipher reference_aes(ctr_key, carry_counter, portable_aes);
+    const uint64_t aes_offsets[] = { 0, 100, 1000003 };
+
+    for (const AesKernel& kernel : aes_kernels)
+    {
+        if (!kernel.is_supported())
+        {
+            std::cout << "  " << std::left << std::setw(8) << kernel.name << " skipped (not supported by this CPU)\n";
+            continue;
+        }
+
+        unsigned char block[16] = {};
+        AesCtrCipher(fips_key, fips_block, kernel).apply(block, block, sizeof(block), 0);
+        bool kernel_passed = std::memcmp(block, fips_expected, sizeof(block)) == 0;
+
+        unsigned char ciphertext[32];
+        AesCtrCipher(ctr_key, ctr_counter, kernel).apply(ciphertext, ctr_plaintext, sizeof(ciphertext), 0);
+        kernel_passed = kernel_passed && std::memcmp(ciphertext, ctr_expected, sizeof(ciphertext)) == 0;
+        if (!kernel_passed)
+        {
+            std::cerr << "AES known-answer mismatch: kernel=" << kernel.name << std::endl;
+        }
+
+        const AesCtrCipher cipher(ctr_key, carry_counter, kernel);
+        for (uint64_t offset : aes_offsets)
+        {
+            std::string expected = data;
+            auto* expected_bytes = reinterpret_cast<unsigned char*>(&expected[0]);
+            reference_aes.apply(expected_bytes, expected_bytes, expected.size(), offset);
+
+            std::string actual = data;
+            auto* actual_bytes = reinterpret_cast<unsigned char*>(&actual[0]);
+            for (size_t position = 0, step = 1; position < actual.size(); position += step, step = step * 3 + 1)
+            {
+                const size_t length = std::min(step, actual.size() - position);
+                cipher.apply(actual_bytes + position, actual_bytes + position, length, offset + position);
+            }
+            if (actual != expected)
+            {
+                std::cerr << "AES-CTR mismatch: kernel=" << kernel.name << " offset=" << offset << std::endl;
+                kernel_passed = false;
+            }
+        }
+
+        std::cout << "  " << std::left << std::setw(8) << kernel.name << (kernel_passed ? " passed" : " FAILED") << "\n";
+        all_passed = all_passed && kernel_passed;
+    }
+
+    return all_passed;
+}
+
+// Each measurement repeats the transform until at least this much wall time has passed
+const double benchmark_min_seconds = 0.05;
+// Default upper end of the buffer-size sweep; --bench-max raises it (up to 4G)
+const uint64_t default_benchmark_max_size = 64u << 20;
+
+/// <summary>
+/// Reads the CPU's time-stamp counter, or returns 0 where there is none. On current x86
+/// CPUs the TSC ticks at a constant reference rate rather than the actual core clock, so
+/// "cycles" are reference cycles: comparable between runs on one machine, not across
+/// machines or turbo states.
+/// </summary>
+uint64_t read_cycle_counter()
+{
+#if defined(ENCRYPTION_X86)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/// <summary>
+/// One timed configuration of the benchmark sweep.
+/// </summary>
+struct BenchmarkResult
+{
+    std::string group;     // which sweep the row belongs to
+    std::string name;      // kernel or cipher measured
+    uint64_t size = 0;     // bytes per call
+    size_t key_length = 0; // XOR key length; 32 for the 256-bit ciphers
+    size_t alignment = 0;  // byte offset of the buffer from a 64-byte boundary
+    unsigned threads = 1;
+    double gigabytes_per_second = 0;
+    double cycles_per_byte = 0;
+};
+
+/// <summary>
+/// Runs transform repeatedly, doubling the repetition count until one batch takes at least
+/// benchmark_min_seconds, and fills in throughput and cycles per byte from that batch.
+/// One untimed call first brings the buffer and key material into cache.
+/// </summary>
+template <typename Transform>
+void measure(BenchmarkResult& result, Transform&& transform)
+{
+    transform();
+    for (uint64_t iterations = 1;; iterations *= 2)
+    {
+        const uint64_t start_cycles = read_cycle_counter();
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            transform();
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t cycles = read_cycle_counter() - start_cycles;
+
+        if (seconds >= benchmark_min_seconds)
+        {
+            const double bytes = static_cast<double>(result.size) * static_cast<double>(iterations);
+            result.gigabytes_per_second = bytes / seconds / 1e9;
+            result.cycles_per_byte = static_cast<double>(cycles) / bytes;
+            return;
+        }
+    }
+}
+
+/// <summary>
+/// Writes the results as one JSON document: the kernels selected on this CPU, then one
+/// object per measurement. cycles_per_byte is null where no cycle counter is available.
+/// </summary>
+void write_benchmark_json(std::ostream& output, const std::vector<BenchmarkResult>& results)
+{
+    output << "{\n"
+           << "  \"xor_kernel\": \"" << active_xor_kernel().name << "\",\n"
+           << "  \"chacha20_kernel\": \"" << active_chacha_kernel().name << "\",\n"
+           << "  \"aes_kernel\": \"" << active_aes_kernel().name << "\",\n"
+           << "  \"hardware_threads\": " << default_thread_count() << ",\n"
+           << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchmarkResult& result = results[i];
+        output << "    {\"group\": \"" << result.group << "\", \"name\": \"" << result.name
+               << "\", \"size\": " << result.size << ", \"key_length\": " << result.key_length
+               << ", \"alignment\": " << result.alignment << ", \"threads\": " << result.threads
+               << std::fixed << std::setprecision(3) << ", \"gb_per_s\": " << result.gigabytes_per_second
+               << ", \"cycles_per_byte\": ";
+        if (result.cycles_per_byte > 0)
+        {
+            output << std::setprecision(4) << result.cycles_per_byte;
+        }
+        else
+        {
+            output << "null";
+        }
+        output << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        output.unsetf(std::ios::floatfield);
+    }
+    output << "  ]\n}\n";
+}
+
+/// <summary>
+/// Measures the transforms in memory, without any file I/O, in five sweeps:
+///   kernels     every XOR kernel (and the public encrypt_decrypt) over buffer sizes
+///   ciphers     FixedKeyXor, ChaCha20 and AES-CTR generators over the same sizes
+///   key_length  the selected XOR kernel at 1 MB for keys of 1 to 4096 bytes
+///   alignment   the selected XOR kernel at 1 MB for buffer offsets 0 to 63
+///   threads     ParallelCipherEngine on the largest buffer for 1 thread up to the hardware count
+/// Buffer sizes run from 64 bytes up to max_size in steps of 4x.
+/// </summary>
+/// <param name="max_size">Largest buffer in the sweeps</param>
+/// <param name="output">Receives the JSON report</param>
+/// <returns>True if the buffer could be allocated and the report written</returns>
+bool run_benchmarks(uint64_t max_size, std::ostream& output)
+{
+    std::vector<uint64_t> sizes;
+    for (uint64_t size = 64; size <= max_size; size *= 4)
+    {
+        sizes.push_back(size);
+    }
+    if (sizes.back() != max_size)
+    {
+        sizes.push_back(max_size);
+    }
+
+    std::unique_ptr<unsigned char[]> storage;
+    try
+    {
+        storage.reset(new unsigned char[static_cast<size_t>(max_size) + key_stream_alignment]);
+    }
+    catch (const std::bad_alloc&)
+    {
+        std::cerr << "Unable to allocate a " << max_size << " byte benchmark buffer" << std::endl;
+        return false;
+    }
+    // Start from a 64-byte boundary so the alignment sweep controls the misalignment exactly
+    unsigned char* const aligned = storage.get() + (key_stream_alignment -
+        reinterpret_cast<uintptr_t>(storage.get()) % key_stream_alignment) % key_stream_alignment;
+    std::memset(aligned, 0x5a, static_cast<size_t>(max_size));
+
+    std::string key_material(4096, '\0');
+    for (size_t i = 0; i < key_material.size(); ++i)
+    {
+        key_material[i] = static_cast<char>('!' + i % 90);
+    }
+    const std::string key = key_material.substr(0, 7);
+    const Sha256::Digest cipher_key = Sha256::hash(key.data(), key.length());
+    const ChaCha20Cipher::Nonce nonce = {};
+    const AesCtrCipher::CounterBlock counter = {};
+
+    std::vector<BenchmarkResult> results;
+    const auto run = [&](const std::string& group, const std::string& name, uint64_t size, size_t key_length,
+                         size_t alignment, unsigned threads, auto&& transform) {
+        BenchmarkResult result;
+        result.group = group;
+        result.name = name;
+        result.size = size;
+        result.key_length = key_length;
+        result.alignment = alignment;
+        result.threads = threads;
+        std::cerr << group << " " << name << " " << size << " bytes..." << std::endl;
+        measure(result, transform);
+        results.push_back(result);
+    };
+
+    for (uint64_t size : sizes)
+    {
+        const auto length = static_cast<size_t>(size);
+        for (const XorKernel& kernel : xor_kernels)
+        {
+            if (kernel.is_supported())
+            {
+                const KeyStream key_stream(key, kernel.function);
+                run("kernels", kernel.name, size, key.length(), 0, 1,
+                    [&] { key_stream.apply(aligned, aligned, length, 0); });
+            }
+        }
+        run("kernels", "encrypt_decrypt", size, key.length(), 0, 1,
+            [&] { encrypt_decrypt(std::span<unsigned char>(aligned, length), key); });
+
+        const FixedKeyXor<8> fixed(key_material.substr(0, 8));
+        run("ciphers", "fixed8", size, 8, 0, 1, [&] { fixed.apply(aligned, aligned, length, 0); });
+        for (const ChaChaKernel& kernel : chacha_kernels)
+        {
+            if (kernel.is_supported())
+            {
+                const ChaCha20Cipher cipher(cipher_key, nonce, 0, kernel);
+                run("ciphers", std::string("chacha20-") + kernel.name, size, cipher_key.size(), 0, 1,
+                    [&] { cipher.apply(aligned, aligned, length, 0); });
+            }
+        }
+        for (const AesKernel& kernel : aes_kernels)
+        {
+            // The portable AES is two orders of magnitude slower; keep it to cache-sized buffers
+            if (kernel.is_supported() && (kernel.function != aes_ctr_blocks_portable || size <= (1u << 20)))
+            {
+                const AesCtrCipher cipher(cipher_key, counter, kernel);
+                run("ciphers", std::string("aes256-ctr-") + kernel.name, size, cipher_key.size(), 0, 1,
+                    [&] { cipher.apply(aligned, aligned, length, 0); });
+            }
+        }
+    }
+
+    const size_t sweep_length = static_cast<size_t>(std::min<uint64_t>(max_size, 1u << 20));
+    for (size_t key_length : { 1, 2, 3, 7, 8, 16, 32, 33, 64, 255, 1000, 1024, 4093, 4096 })
+    {
+        const KeyStream key_stream(key_material.substr(0, key_length));
+        run("key_length", active_xor_kernel().name, sweep_length, key_length, 0, 1,
+            [&] { key_stream.apply(aligned, aligned, sweep_length, 0); });
+    }
+
+    const KeyStream key_stream(key);
+    for (size_t alignment : { 0, 1, 3, 8, 15, 16, 31, 32, 63 })
+    {
+        // The buffer has key_stream_alignment bytes of slack past max_size for these offsets
+        run("alignment", active_xor_kernel().name, sweep_length, key.length(), alignment, 1,
+            [&] { key_stream.apply(aligned + alignment, aligned + alignment, sweep_length, 0); });
+    }
+
+    const auto largest = static_cast<size_t>(max_size);
+    for (unsigned threads = 1;; threads = std::min(threads * 2, default_thread_count()))
+    {
+        ParallelCipherEngine engine(KeyStream(key), threads);
+        run("threads", "engine", max_size, key.length(), 0, threads,
+            [&] { engine.transform(aligned, aligned, largest, 0); });
+        if (threads == default_thread_count())
+        {
+            break;
+        }
+    }
+
+    write_benchmark_json(output, results);
+    return static_cast<bool>(output);
+}
+
+/// <summary>
+/// Collects per-stage wall times for --profile and --trace: how long each open, read,
+/// transform, write, fsync and compare took and how many bytes it moved. Nothing is
+/// recorded until enable() is called, so the I/O paths time their stages unconditionally.
+/// In the parallel, pipeline and io_uring modes stages run at the same time, so the
+/// per-stage totals can add up to more than the wall time; the trace shows the overlap.
+/// </summary>
+class StageProfiler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static StageProfiler& instance()
+    {
+        static StageProfiler profiler;
+        return profiler;
+    }
+
+    void enable()
+    {
+        m_start = Clock::now();
+        m_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Adds one stage occurrence. stage must be a string literal; it is stored, not copied.
+    /// </summary>
+    void record(const char* stage, Clock::time_point start, Clock::time_point end, uint64_t bytes)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        const unsigned thread = thread_index();
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto total = std::find_if(m_totals.begin(), m_totals.end(),
+                                  [stage](const StageTotal& t) { return std::strcmp(t.stage, stage) == 0; });
+        if (total == m_totals.end())
+        {
+            total = m_totals.insert(m_totals.end(), StageTotal{ stage });
+        }
+        ++total->calls;
+        total->seconds += seconds;
+        total->bytes += bytes;
+
+        if (m_events.size() < max_trace_events)
+        {
+            m_events.push_back(Event{ stage, start, seconds, bytes, thread });
+        }
+        else
+        {
+            ++m_dropped_events;
+        }
+    }
+
+    /// <summary>
+    /// Writes per-stage totals as JSON. io_seconds (open, read, write, fsync) against
+    /// cpu_seconds (transform, verify, compress, decompress) answers whether a run was
+    /// disk- or CPU-bound.
+    /// </summary>
+    void write_summary(std::ostream& output) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const double wall_seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+        double io_seconds = 0;
+        double cpu_seconds = 0;
+
+        output << std::fixed << std::setprecision(6) << "{\n  \"wall_seconds\": " << wall_seconds << ",\n  \"stages\": [\n";
+        for (size_t i = 0; i < m_totals.size(); ++i)
+        {
+            const StageTotal& total = m_totals[i];
+            const std::string_view stage = total.stage;
+            if (stage == "transform" || stage == "verify" || stage == "compress" || stage == "decompress")
+            {
+                cpu_seconds += total.seconds;
+            }
+            else if (stage != "compare")
+            {
+                io_seconds += total.seconds;
+            }
+
+            const double throughput = total.seconds > 0 ? static_cast<double>(total.bytes) / total.seconds / 1e6 : 0;
+            output << "    {\"stage\": \"" << total.stage << "\", \"calls\": " << total.calls
+                   << ", \"seconds\": " << total.seconds << ", \"bytes\": " << total.bytes
+                   << ", \"mb_per_s\": " << std::setprecision(1) << throughput << std::setprecision(6) << "}"
+                   << (i + 1 < m_totals.size() ? "," : "") << "\n";
+        }
+        output << "  ],\n"
+               << "  \"io_seconds\": " << io_seconds << ",\n"
+               << "  \"cpu_seconds\": " << cpu_seconds << ",\n"
+               << "  \"bound\": \"" << (io_seconds >= cpu_seconds ? "io" : "cpu") << "\"\n"
+               << "}\n";
+        output.unsetf(std::ios::floatfield);
+    }
+
+    /// <summary>
+    /// Writes every recorded stage occurrence in the Trace Event Format, which
+    /// chrome://tracing and Perfetto load directly. Each thread gets its own track.
+    /// </summary>
+    void write_trace(std::ostream& output) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        output << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (size_t i = 0; i < m_events.size(); ++i)
+        {
+            const Event& event = m_events[i];
+            const double start_us = std::chrono::duration<double, std::micro>(event.start - m_start).count();
+            output << "  {\"name\": \"" << event.stage << "\", \"cat\": \"stage\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                   << event.thread << ", \"ts\": " << start_us << ", \"dur\": " << event.seconds * 1e6
+                   << ", \"args\": {\"bytes\": " << event.bytes << "}}" << (i + 1 < m_events.size() ? "," : "") << "\n";
+        }
+        output << "], \"otherData\": {\"dropped_events\": " << m_dropped_events << "}}\n";
+        output.unsetf(std::ios::floatfield);
+    }
+
+private:
+    // Bounds the trace's memory on huge inputs; totals keep counting past it
+    static const size_t max_trace_events = 1u << 20;
+
+    struct StageTotal
+    {
+        const char* stage;
+        uint64_t calls = 0;
+        double seconds = 0;
+        uint64_t bytes = 0;
+    };
+
+    struct Event
+    {
+        const char* stage;
+        Clock::time_point start;
+        double seconds;
+        uint64_t bytes;
+        unsigned thread;
+    };
+
+    // Small, stable per-thread numbers for the trace's tid field
+    static unsigned thread_index()
+    {
+        static std::atomic<unsigned> next_index{ 0 };
+        thread_local const unsigned index = next_index.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+    std::atomic<bool> m_enabled{ false };
+    Clock::time_point m_start;
+    mutable std::mutex m_mutex;
+    std::vector<StageTotal> m_totals;
+    std::vector<Event> m_events;
+    uint64_t m_dropped_events = 0;
+};
+
+/// <summary>
+/// Times one stage from construction to finish() (or destruction, on early returns) and
+/// reports it to the StageProfiler. Costs one relaxed load while profiling is off.
+/// </summary>
+class StageTimer
+{
+public:
+    explicit StageTimer(const char* stage)
+        : m_stage(stage),
+          m_active(StageProfiler::instance().enabled())
+    {
+        if (m_active)
+        {
+            m_start = StageProfiler::Clock::now();
+        }
+    }
+
+    ~StageTimer() { finish(m_bytes); }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    void set_bytes(uint64_t bytes) { m_bytes = bytes; }
+
+    void finish(uint64_t bytes = 0)
+    {
+        if (m_active)
+        {
+            m_active = false;
+            StageProfiler::instance().record(m_stage, m_start, StageProfiler::Clock::now(), bytes);
+        }
+    }
+
+private:
+    const char* m_stage;
+    bool m_active;
+    uint64_t m_bytes = 0;
+    StageProfiler::Clock::time_point m_start;
+};
+
+/// <summary>
+/// Flushes a written file to stable storage (fsync, or FlushFileBuffers on Windows), so a
+/// run with --fsync includes the time the disk needs to make the data durable.
+/// </summary>
+/// <param name="filename">File to flush</param>
+/// <returns>True if the file was flushed</returns>
+bool sync_file(const std::string& filename)
+{
+    StageTimer timer("fsync");
+#if defined(_WIN32)
+    const HANDLE file = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size = {};
+    const bool synced = file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size) && FlushFileBuffers(file);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+    timer.set_bytes(static_cast<uint64_t>(size.QuadPart));
+#else
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat info = {};
+    const bool synced = fd >= 0 && fstat(fd, &info) == 0 && fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    timer.set_bytes(static_cast<uint64_t>(info.st_size));
+#endif
+    if (!synced)
+    {
+        std::cerr << "Unable to flush file to disk: " << filename << std::endl;
+    }
+    return synced;
+}
+
+/// <summary>
+/// Reads the entire contents of a file into a single string.
+/// Supports binary mode for handling any type of data.
+/// </summary>
+/// <param name="filename">Name of the file to read</param>
+/// <returns>File contents as a string, or empty string if reading fails</returns>
+std::string read_file(const std::string& filename)
+{
+    StageTimer open_timer("open");
+    std::ifstream input_file_stream(filename, std::ios::in | std::ios::binary);
+    if (!input_file_stream)
+    {
+        std::cerr << "Unable to open file: " << filename << std::endl;
+        return "";
+    }
+    open_timer.finish();
+
+    // Read straight into a string of the file's size; going through an ostringstream would
+    // grow its buffer step by step and then copy all of it out with str()
+    StageTimer read_timer("read");
+    std::string content;
+    input_file_stream.seekg(0, std::ios::end);
+    const std::streamoff size = input_file_stream.tellg();
+    input_file_stream.seekg(0, std::ios::beg);
+    if (size > 0 && input_file_stream)
+    {
+        content.resize(static_cast<size_t>(size));
+        input_file_stream.read(&content[0], size);
+        content.resize(static_cast<size_t>(input_file_stream.gcount()));
+    }
+    else
+    {
+        // Not seekable, such as a pipe: read it in whatever pieces it comes
+        input_file_stream.clear();
+        std::ostringstream ss;
+        ss << input_file_stream.rdbuf();
+        content = ss.str();
+    }
+    read_timer.finish(content.size());
+    return content;
+}
+
+/// <summary>
+/// Writes a string to a file in binary mode.
+/// Overwrites existing content if the file already exists.
+/// </summary>
+/// <param name="filename">Name of the file to write</param>
+/// <param name="content">The content to write to the file</param>
+void write_file(const std::string& filename, const std::string& content)
+{
+    StageTimer open_timer("open");
+    std::ofstream output_file_stream(filename, std::ios::out | std::ios::binary);
+    if (!output_file_stream)
+    {
+        std::cerr << "Unable to open file for writing: " << filename << std::endl;
+        return;
+    }
+    open_timer.finish();
+
+    StageTimer write_timer("write");
+    output_file_stream << content;
+    output_file_stream.flush();
+    write_timer.finish(content.size());
+}
+
+/// <summary>
+/// Process-wide cap on buffer memory for --max-mem. Every arena buffer is charged to it
+/// from allocation until it is freed, idle or not. A thread that would go over the limit
+/// waits until other threads give memory back, so batch workers stall on their reads
+/// instead of the process being killed. Only a thread that holds no buffers waits, so two
+/// threads can never wait on each other, and it goes ahead when nothing else is in use,
+/// since then waiting could never end. A thread that already holds a buffer takes its
+/// next one regardless; the sizes in the options are fitted to the budget up front (see
+/// fit_memory_budget), so the limit is only exceeded when a single operation needs more.
+/// Without --max-mem the limit is 0 and nothing is checked.
+/// </summary>
+class MemoryBudget
+{
+public:
+    static MemoryBudget& instance()
+    {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    void set_limit(uint64_t limit)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_limit = limit;
+    }
+
+    uint64_t limit() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_limit;
+    }
+
+    uint64_t peak() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_peak;
+    }
+
+    bool has_waiters() const
+    {
+        return m_waiters.load(std::memory_order_relaxed) > 0;
+    }
+
+    /// <summary>
+    /// Charges bytes to the budget. If they would exceed the limit and the calling thread
+    /// holds no buffers, waits while any memory is in use that can come back. reclaim is
+    /// called before every wait to free idle buffers, which would otherwise never return.
+    /// </summary>
+    /// <param name="held">Bytes of checked-out buffers the calling thread holds</param>
+    template <typename Reclaim>
+    void reserve(uint64_t bytes, uint64_t held, Reclaim&& reclaim)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_limit != 0 && m_used + bytes > m_limit && held == 0)
+        {
+            m_waiters.fetch_add(1);
+            while (m_used + bytes > m_limit && m_used > 0)
+            {
+                lock.unlock();
+                reclaim();
+                lock.lock();
+                if (m_used + bytes <= m_limit || m_used == 0)
+                {
+                    break;
+                }
+                // A buffer returned to an idle list does not notify; the timeout catches it
+                m_released.wait_for(lock, std::chrono::milliseconds(20));
+            }
+            m_waiters.fetch_sub(1);
+        }
+        m_used += bytes;
+        m_peak = std::max(m_peak, m_used);
+    }
+
+    void release(uint64_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_used -= bytes;
+        }
+        m_released.notify_all();
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_released;
+    uint64_t m_limit = 0;
+    uint64_t m_used = 0;
+    uint64_t m_peak = 0;
+    std::atomic<unsigned> m_waiters{ 0 };
+};
+
+// Arena buffers come in power-of-two size classes from 4 KB up, page-aligned so that the
+// direct I/O path can use them too
+const size_t arena_alignment = 4096;
+const size_t arena_min_buffer_size = 4096;
+// Idle buffers each thread keeps for reuse; a larger buffer is freed when it is returned
+const size_t arena_max_idle_bytes = 64u << 20;
+const size_t arena_class_count = 15; // 4 KB to 64 MB
+
+/// <summary>
+/// Per-thread pool of I/O buffers. The read, transform and write stages check a buffer out
+/// with acquire and it goes back when the Buffer is destroyed, to the arena of the thread
+/// that destroys it. A batch run over millions of small files then reuses the same few
+/// buffers on every pool worker instead of allocating, faulting in and freeing a fresh
+/// buffer per file. Every arena is used by its own thread, except when a thread waiting on
+/// the MemoryBudget frees the idle buffers of all of them, so the lock is uncontended.
+/// </summary>
+class BufferArena
+{
+public:
+    /// <summary>
+    /// A buffer checked out of an arena; returned to the current thread's arena when destroyed.
+    /// </summary>
+    class Buffer
+    {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept
+            : m_data(std::exchange(other.m_data, nullptr)), m_capacity(std::exchange(other.m_capacity, 0))
+        {
+        }
+        Buffer& operator=(Buffer&& other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                m_data = std::exchange(other.m_data, nullptr);
+                m_capacity = std::exchange(other.m_capacity, 0);
+            }
+            return *this;
+        }
+        ~Buffer()
+        {
+            release();
+        }
+
+        unsigned char* get() const { return m_data; }
+        size_t capacity() const { return m_capacity; }
+
+    private:
+        friend class BufferArena;
+        Buffer(unsigned char* data, size_t capacity) : m_data(data), m_capacity(capacity) {}
+
+        void release()
+        {
+            if (m_data != nullptr)
+            {
+                BufferArena::local().give_back(m_data, m_capacity);
+                m_data = nullptr;
+            }
+        }
+
+        unsigned char* m_data = nullptr;
+        size_t m_capacity = 0;
+    };
+
+    BufferArena()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+
+    ~BufferArena()
+    {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            std::vector<BufferArena*>& arenas = registry();
+            arenas.erase(std::find(arenas.begin(), arenas.end(), this));
+        }
+        free_idle();
+    }
+
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+    /// <summary>
+    /// The calling thread's arena.
+    /// </summary>
+    static BufferArena& local()
+    {
+        thread_local BufferArena arena;
+        return arena;
+    }
+
+    /// <summary>
+    /// Checks out a page-aligned buffer of at least size bytes, reusing an idle one of the
+    /// same size class if there is one. A new buffer is charged to the MemoryBudget first,
+    /// which may wait. Throws std::bad_alloc like new.
+    /// </summary>
+    Buffer acquire(size_t size)
+    {
+        size_t capacity = std::bit_ceil(std::max(size, arena_min_buffer_size));
+        if (capacity <= arena_max_idle_bytes)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<unsigned char*>& idle = m_idle[size_class(capacity)];
+            if (!idle.empty())
+            {
+                unsigned char* data = idle.back();
+                idle.pop_back();
+                m_idle_bytes -= capacity;
+                m_live_bytes += capacity;
+                return Buffer(data, capacity);
+            }
+        }
+        else
+        {
+            capacity = (size + arena_alignment - 1) / arena_alignment * arena_alignment;
+        }
+
+        MemoryBudget& budget = MemoryBudget::instance();
+        budget.reserve(capacity, held_bytes(), [] { trim_all(); });
+        unsigned char* data = nullptr;
+        try
+        {
+            data = static_cast<unsigned char*>(::operator new(capacity, std::align_val_t(arena_alignment)));
+        }
+        catch (const std::bad_alloc&)
+        {
+            budget.release(capacity);
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_live_bytes += capacity;
+        return Buffer(data, capacity);
+    }
+
+    /// <summary>
+    /// Frees the idle buffers of every thread's arena, returning their memory to the budget.
+    /// </summary>
+    static void trim_all()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (BufferArena* arena : registry())
+        {
+            arena->free_idle();
+        }
+    }
+
+    /// <summary>
+    /// Bytes acquire(size) takes from the budget: the size rounded up to its size class.
+    /// </summary>
+    static uint64_t footprint(uint64_t size)
+    {
+        const uint64_t capacity = std::bit_ceil(std::max<uint64_t>(size, arena_min_buffer_size));
+        return capacity <= arena_max_idle_bytes ? capacity : (size + arena_alignment - 1) / arena_alignment * arena_alignment;
+    }
+
+private:
+    static size_t size_class(size_t capacity)
+    {
+        return static_cast<size_t>(std::countr_zero(capacity) - std::countr_zero(arena_min_buffer_size));
+    }
+
+    static std::mutex& registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<BufferArena*>& registry()
+    {
+        static std::vector<BufferArena*> arenas;
+        return arenas;
+    }
+
+    // Idle buffers are left out: a waiting thread frees its own along with everyone else's
+    uint64_t held_bytes()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_live_bytes;
+    }
+
+    void give_back(unsigned char* data, size_t capacity)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // A buffer checked out on another thread is not part of this arena's count
+            m_live_bytes -= std::min<uint64_t>(m_live_bytes, capacity);
+
+            // While a thread waits on the budget, memory goes straight back to it
+            if (std::has_single_bit(capacity) && capacity <= arena_max_idle_bytes &&
+                m_idle_bytes + capacity <= arena_max_idle_bytes && !MemoryBudget::instance().has_waiters())
+            {
+                m_idle[size_class(capacity)].push_back(data);
+                m_idle_bytes += capacity;
+                return;
+            }
+        }
+        ::operator delete(data, std::align_val_t(arena_alignment));
+        MemoryBudget::instance().release(capacity);
+    }
+
+    void free_idle()
+    {
+        uint64_t freed = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (size_t i = 0; i < m_idle.size(); ++i)
+            {
+                for (unsigned char* data : m_idle[i])
+                {
+                    ::operator delete(data, std::align_val_t(arena_alignment));
+                }
+                freed += m_idle[i].size() * (arena_min_buffer_size << i);
+                m_idle[i].clear();
+            }
+            m_idle_bytes = 0;
+        }
+        if (freed > 0)
+        {
+            MemoryBudget::instance().release(freed);
+        }
+    }
+
+    std::mutex m_mutex;
+    std::array<std::vector<unsigned char*>, arena_class_count> m_idle;
+    uint64_t m_idle_bytes = 0;
+    uint64_t m_live_bytes = 0;
+};
+
+// Default size of the single buffer used by the streaming mode
+const size_t default_stream_buffer_size = 1 << 20;
+
+/// <summary>
+/// Encrypts or decrypts a file without loading it into memory. One fixed-size buffer is
+/// filled from the input, transformed in place and written out, so memory use does not
+/// depend on the file size. The key phase is carried across buffer boundaries, so the
+/// output is identical to encrypt_decrypt on the whole file.
+/// </summary>
+/// <param name="input_filename">File to read (plaintext or ciphertext)</param>
+/// <param name="output_filename">File to write; overwritten if it exists</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="buffer_size">Size of the transfer buffer in bytes</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole input was transformed and written</returns>
+template <typename Engine>
+bool stream_transform_file(const std::string& input_filename, const std::string& output_filename,
+                           Engine& engine, size_t buffer_size, uint64_t& bytes_processed)
+{
+    assert(buffer_size > 0);
+    bytes_processed = 0;
+
+    // The streams are unbuffered: every transfer is a whole arena buffer, so their own
+    // buffers would only add an allocation and a copy per file
+    StageTimer open_timer("open");
+    std::ifstream input_file_stream;
+    input_file_stream.rdbuf()->pubsetbuf(nullptr, 0);
+    input_file_stream.open(input_filename, std::ios::in | std::ios::binary);
+    if (!input_file_stream)
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+
+    std::ofstream output_file_stream;
+    output_file_stream.rdbuf()->pubsetbuf(nullptr, 0);
+    output_file_stream.open(output_filename, std::ios::out | std::ios::binary);
+    if (!output_file_stream)
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    const BufferArena::Buffer arena_buffer = BufferArena::local().acquire(buffer_size);
+    char* const buffer = reinterpret_cast<char*>(arena_buffer.get());
+
+    while (input_file_stream)
+    {
+        StageTimer read_timer("read");
+        input_file_stream.read(buffer, static_cast<std::streamsize>(buffer_size));
+        const auto count = static_cast<size_t>(input_file_stream.gcount());
+        read_timer.finish(count);
+        if (count == 0)
+        {
+            break;
+        }
+
+        StageTimer transform_timer("transform");
+        engine.transform(arena_buffer.get(), arena_buffer.get(), count, bytes_processed);
+        transform_timer.finish(count);
+
+        StageTimer write_timer("write");
+        if (!output_file_stream.write(buffer, static_cast<std::streamsize>(count)))
+        {
+            std::cerr << "Error writing to file: " << output_filename << std::endl;
+            return false;
+        }
+        write_timer.finish(count);
+        bytes_processed += count;
+    }
+
+    if (input_file_stream.bad())
+    {
+        std::cerr << "Error reading file: " << input_filename << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Files are mapped in windows of this size. Windowing keeps 32-bit builds working on files
+// larger than their address space and bounds how much of the page cache one run pins.
+// It is a multiple of the Windows allocation granularity, as MapViewOfFile requires.
+const size_t mmap_window_size = 64u << 20;
+
+/// <summary>
+/// A file opened for memory-mapped access, one window at a time.
+/// Wraps mmap/madvise on POSIX systems and CreateFileMapping/MapViewOfFile on Windows.
+/// </summary>
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// <summary>
+    /// Opens an existing file. A writable mapping writes changes straight back to the file.
+    /// </summary>
+    bool open(const std::string& filename, bool writable)
+    {
+        close();
+        m_writable = writable;
+#if defined(_WIN32)
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+        m_fd = ::open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+        struct stat info;
+        if (m_fd < 0 || fstat(m_fd, &info) != 0)
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(info.st_size);
+#endif
+        return create_mapping();
+    }
+
+    /// <summary>
+    /// Creates or truncates a file and reserves size bytes for it, so writes through the
+    /// mapping cannot fail later for lack of disk space.
+    /// </summary>
+    bool create(const std::string& filename, uint64_t size)
+    {
+        close();
+        m_writable = true;
+        m_size = size;
+#if defined(_WIN32)
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                             FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(size);
+        if (m_file == INVALID_HANDLE_VALUE || !SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN) ||
+            !SetEndOfFile(m_file))
+        {
+            close();
+            return false;
+        }
+#else
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+        {
+            close();
+            return false;
+        }
+        bool reserved = false;
+#if defined(__linux__)
+        reserved = size == 0 || fallocate(m_fd, 0, 0, static_cast<off_t>(size)) == 0;
+#endif
+        // Filesystems without fallocate still get the right size, just not reserved blocks
+        if (!reserved && ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+        {
+            close();
+            return false;
+        }
+#endif
+        return create_mapping();
+    }
+
+    uint64_t size() const { return m_size; }
+
+    /// <summary>
+    /// Maps [offset, offset + length) and returns a pointer to its first byte, or nullptr on
+    /// failure. offset must be a multiple of mmap_window_size. The previous window, if any,
+    /// is unmapped first. The kernel is told the window will be read sequentially.
+    /// </summary>
+    unsigned char* map(uint64_t offset, size_t length)
+    {
+        unmap();
+#if defined(_WIN32)
+        m_view = MapViewOfFile(m_mapping, m_writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                               static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), length);
+        if (m_view == nullptr)
+        {
+            return nullptr;
+        }
+#else
+        void* view = mmap(nullptr, length, PROT_READ | (m_writable ? PROT_WRITE : 0), MAP_SHARED, m_fd,
+                          static_cast<off_t>(offset));
+        if (view == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        madvise(view, length, MADV_SEQUENTIAL);
+        m_view = view;
+#endif
+        m_view_length = length;
+        return static_cast<unsigned char*>(m_view);
+    }
+
+    void unmap()
+    {
+        if (m_view == nullptr)
+        {
+            return;
+        }
+#if defined(_WIN32)
+        UnmapViewOfFile(m_view);
+#else
+        munmap(m_view, m_view_length);
+#endif
+        m_view = nullptr;
+        m_view_length = 0;
+    }
+
+    void close()
+    {
+        unmap();
+#if defined(_WIN32)
+        if (m_mapping != nullptr)
+        {
+            CloseHandle(m_mapping);
+            m_mapping = nullptr;
+        }
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+            m_file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+#endif
+    }
+
+private:
+    bool create_mapping()
+    {
+#if defined(_WIN32)
+        // Windows cannot map an empty file; there is nothing to transform anyway
+        if (m_size > 0)
+        {
+            m_mapping = CreateFileMappingA(m_file, nullptr, m_writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping == nullptr)
+            {
+                close();
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+    void* m_view = nullptr;
+    size_t m_view_length = 0;
+    uint64_t m_size = 0;
+    bool m_writable = false;
+};
+
+/// <summary>
+/// Encrypts or decrypts a file by mapping the input and a preallocated output file and
+/// XORing straight from one mapping into the other. No read() or write() copies are
+/// made; the page cache pages are the only buffers.
+/// </summary>
+/// <param name="input_filename">File to read (plaintext or ciphertext)</param>
+/// <param name="output_filename">File to write; overwritten if it exists</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole input was transformed and written</returns>
+template <typename Engine>
+bool mmap_transform_file(const std::string& input_filename, const std::string& output_filename,
+                         Engine& engine, uint64_t& bytes_processed)
+{
+    bytes_processed = 0;
+
+    StageTimer open_timer("open");
+    MappedFile source;
+    if (!source.open(input_filename, false))
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+
+    MappedFile destination;
+    if (!destination.create(output_filename, source.size()))
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    for (uint64_t offset = 0; offset < source.size(); offset += mmap_window_size)
+    {
+        const auto length = static_cast<size_t>(std::min<uint64_t>(mmap_window_size, source.size() - offset));
+        const unsigned char* src = source.map(offset, length);
+        unsigned char* dst = destination.map(offset, length);
+        if (src == nullptr || dst == nullptr)
+        {
+            std::cerr << "Unable to map " << input_filename << " or " << output_filename << " at offset " << offset << std::endl;
+            return false;
+        }
+
+        // Page faults on the two windows are the reads and writes, so they land in this stage
+        StageTimer transform_timer("transform");
+        engine.transform(dst, src, length, offset);
+        transform_timer.finish(length);
+        bytes_processed += length;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Encrypts or decrypts a file in place through a writable mapping. The file is never
+/// copied: each page is read, XORed and written back by the page cache.
+/// </summary>
+/// <param name="filename">File to transform</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole file was transformed</returns>
+template <typename Engine>
+bool mmap_transform_in_place(const std::string& filename, Engine& engine, uint64_t& bytes_processed)
+{
+    bytes_processed = 0;
+
+    StageTimer open_timer("open");
+    MappedFile file;
+    if (!file.open(filename, true))
+    {
+        std::cerr << "Unable to open file for writing: " << filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    for (uint64_t offset = 0; offset < file.size(); offset += mmap_window_size)
+    {
+        const auto length = static_cast<size_t>(std::min<uint64_t>(mmap_window_size, file.size() - offset));
+        unsigned char* bytes = file.map(offset, length);
+        if (bytes == nullptr)
+        {
+            std::cerr << "Unable to map " << filename << " at offset " << offset << std::endl;
+            return false;
+        }
+
+        StageTimer transform_timer("transform");
+        engine.transform(bytes, bytes, length, offset);
+        transform_timer.finish(length);
+        bytes_processed += length;
+    }
+
+    return true;
+}
+
+// Number of buffers kept in flight by the io_uring mode unless --queue-depth says otherwise
+const unsigned default_queue_depth = 8;
+
+#if defined(ENCRYPTION_IO_URING)
+/// <summary>
+/// Closes a POSIX file descriptor when it goes out of scope.
+/// </summary>
+struct FileDescriptor
+{
+    explicit FileDescriptor(int descriptor = -1) : fd(descriptor) {}
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int fd;
+};
+
+/// <summary>
+/// Minimal io_uring wrapper over the raw system calls, so the tool does not depend on
+/// liburing. It maps the submission and completion rings, hands out submission entries
+/// and reaps completions; the caller fills in the operations.
+/// </summary>
+class IoUring
+{
+public:
+    IoUring() = default;
+    ~IoUring()
+    {
+        if (m_sqes != nullptr)
+        {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring)
+        {
+            munmap(m_cq_ring, m_cq_ring_size);
+        }
+        if (m_sq_ring != nullptr)
+        {
+            munmap(m_sq_ring, m_sq_ring_size);
+        }
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+        }
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    /// <summary>
+    /// Creates the ring. Fails on kernels without io_uring or where it is disabled.
+    /// </summary>
+    bool init(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0)
+        {
+            return false;
+        }
+
+        m_sq_entries = params.sq_entries;
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap)
+        {
+            m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        }
+
+        m_sq_ring = map_region(m_sq_ring_size, IORING_OFF_SQ_RING);
+        m_cq_ring = single_mmap ? m_sq_ring : map_region(m_cq_ring_size, IORING_OFF_CQ_RING);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(map_region(m_sqes_size, IORING_OFF_SQES));
+        if (m_sq_ring == nullptr || m_cq_ring == nullptr || m_sqes == nullptr)
+        {
+            return false;
+        }
+
+        auto* sq = static_cast<unsigned char*>(m_sq_ring);
+        m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sq_local_tail = *m_sq_tail;
+
+        auto* cq = static_cast<unsigned char*>(m_cq_ring);
+        m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    /// <summary>
+    /// Pins buffers in the kernel so READ_FIXED/WRITE_FIXED skip the per-I/O page mapping.
+    /// Fails if the locked-memory limit is too low; plain reads and writes still work then.
+    /// </summary>
+    bool register_buffers(const iovec* buffers, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+    /// <summary>
+    /// Returns a zeroed submission entry, or nullptr if the submission queue is full.
+    /// </summary>
+    io_uring_sqe* next_sqe()
+    {
+        const unsigned head = std::atomic_ref<unsigned>(*m_sq_head).load(std::memory_order_acquire);
+        if (m_sq_local_tail - head >= m_sq_entries)
+        {
+            return nullptr;
+        }
+
+        const unsigned index = m_sq_local_tail & m_sq_mask;
+        io_uring_sqe* sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        ++m_sq_local_tail;
+        ++m_pending_submissions;
+        return sqe;
+    }
+
+    /// <summary>
+    /// Publishes the prepared entries to the kernel and, if wait_for is non-zero, blocks
+    /// until at least that many completions are available.
+    /// </summary>
+    bool submit(unsigned wait_for)
+    {
+        std::atomic_ref<unsigned>(*m_sq_tail).store(m_sq_local_tail, std::memory_order_release);
+        for (;;)
+        {
+            const long submitted = syscall(__NR_io_uring_enter, m_fd, m_pending_submissions, wait_for,
+                                           wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (submitted >= 0)
+            {
+                m_pending_submissions -= static_cast<unsigned>(submitted);
+                return true;
+            }
+            if (errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Copies out the oldest completion, if there is one, and releases its ring slot.
+    /// </summary>
+    bool pop_completion(io_uring_cqe& completion)
+    {
+        const unsigned head = *m_cq_head;
+        if (head == std::atomic_ref<unsigned>(*m_cq_tail).load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        completion = m_cqes[head & m_cq_mask];
+        std::atomic_ref<unsigned>(*m_cq_head).store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    void* map_region(size_t size, off_t offset)
+    {
+        void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return region == MAP_FAILED ? nullptr : region;
+    }
+
+    int m_fd = -1;
+    void* m_sq_ring = nullptr;
+    void* m_cq_ring = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    size_t m_sqes_size = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned m_sq_entries = 0;
+    unsigned m_sq_local_tail = 0;
+    unsigned m_pending_submissions = 0;
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+#endif
+
+/// <summary>
+/// Encrypts or decrypts a file with io_uring: queue_depth buffers cycle through
+/// read -> XOR -> write, and while one buffer is being transformed the others have reads or
+/// writes in flight, so the CPU work overlaps with storage latency. Buffers are registered
+/// with the kernel when the locked-memory limit allows.
+/// Where io_uring is unavailable (other platforms, old kernels, seccomp filters) the
+/// blocking stream_transform_file path is used instead.
+/// </summary>
+/// <param name="input_filename">File to read (plaintext or ciphertext)</param>
+/// <param name="output_filename">File to write; overwritten if it exists</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="buffer_size">Size of each of the queue_depth buffers</param>
+/// <param name="queue_depth">Number of buffers in flight</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole input was transformed and written</returns>
+template <typename Engine>
+bool uring_transform_file(const std::string& input_filename, const std::string& output_filename,
+                          Engine& engine, size_t buffer_size, unsigned queue_depth,
+                          uint64_t& bytes_processed)
+{
+    assert(buffer_size > 0 && queue_depth > 0);
+    bytes_processed = 0;
+
+#if defined(ENCRYPTION_IO_URING)
+    IoUring ring;
+    if (!ring.init(queue_depth * 2))
+    {
+        std::cerr << "io_uring is not available; falling back to blocking I/O" << std::endl;
+        return stream_transform_file(input_filename, output_filename, engine, buffer_size, bytes_processed);
+    }
+
+    StageTimer open_timer("open");
+    const FileDescriptor input(::open(input_filename.c_str(), O_RDONLY));
+    struct stat info;
+    if (input.fd < 0 || fstat(input.fd, &info) != 0)
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+    const auto file_size = static_cast<uint64_t>(info.st_size);
+
+    const FileDescriptor output(::open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (output.fd < 0)
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    struct Slot
+    {
+        unsigned char* buffer;
+        uint64_t offset;
+        size_t length;
+        size_t done;
+        StageProfiler::Clock::time_point issued; // when the current read or write was first queued
+    };
+
+    const BufferArena::Buffer storage = BufferArena::local().acquire(buffer_size * queue_depth);
+
+    std::vector<Slot> slots(queue_depth);
+    std::vector<iovec> registrations(queue_depth);
+    for (unsigned i = 0; i < queue_depth; ++i)
+    {
+        slots[i].buffer = storage.get() + i * buffer_size;
+        registrations[i].iov_base = slots[i].buffer;
+        registrations[i].iov_len = buffer_size;
+    }
+    const bool fixed_buffers = ring.register_buffers(registrations.data(), queue_depth);
+
+    // user_data carries the slot index and whether the operation is the write
+    const auto queue_io = [&](unsigned index, bool is_write) {
+        Slot& slot = slots[index];
+        io_uring_sqe* sqe = ring.next_sqe();
+        if (sqe == nullptr)
+        {
+            ring.submit(0);
+            sqe = ring.next_sqe();
+        }
+        if (fixed_buffers)
+        {
+            sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = static_cast<uint16_t>(index);
+        }
+        else
+        {
+            sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd = is_write ? output.fd : input.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.buffer + slot.done);
+        sqe->len = static_cast<uint32_t>(slot.length - slot.done);
+        sqe->off = slot.offset + slot.done;
+        sqe->user_data = (static_cast<uint64_t>(index) << 1) | (is_write ? 1 : 0);
+    };
+
+    uint64_t next_offset = 0;
+    const auto start_read = [&](unsigned index) {
+        Slot& slot = slots[index];
+        slot.offset = next_offset;
+        slot.length = static_cast<size_t>(std::min<uint64_t>(buffer_size, file_size - next_offset));
+        slot.done = 0;
+        slot.issued = StageProfiler::Clock::now();
+        next_offset += slot.length;
+        queue_io(index, false);
+    };
+
+    unsigned busy_slots = 0;
+    for (unsigned i = 0; i < queue_depth && next_offset < file_size; ++i)
+    {
+        start_read(i);
+        ++busy_slots;
+    }
+
+    bool failed = false;
+    while (busy_slots > 0)
+    {
+        if (!ring.submit(1))
+        {
+            std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        io_uring_cqe completion;
+        while (ring.pop_completion(completion))
+        {
+            const auto index = static_cast<unsigned>(completion.user_data >> 1);
+            const bool was_write = (completion.user_data & 1) != 0;
+            Slot& slot = slots[index];
+
+            if (completion.res <= 0)
+            {
+                // A zero-length read means the input shrank while we were reading it
+                std::cerr << "Error " << (was_write ? "writing to " : "reading ")
+                          << (was_write ? output_filename : input_filename) << " at offset " << slot.offset << ": "
+                          << (completion.res < 0 ? std::strerror(-completion.res) : "unexpected end of file") << std::endl;
+                failed = true;
+                --busy_slots;
+                continue;
+            }
+
+            // Short transfers are resumed where they stopped
+            slot.done += static_cast<size_t>(completion.res);
+            if (slot.done < slot.length)
+            {
+                queue_io(index, was_write);
+                continue;
+            }
+
+            // Reads and writes are timed from submission to completion, so they overlap
+            const auto completed = StageProfiler::Clock::now();
+            StageProfiler::instance().record(was_write ? "write" : "read", slot.issued, completed, slot.length);
+
+            if (!was_write)
+            {
+                StageTimer transform_timer("transform");
+                engine.transform(slot.buffer, slot.buffer, slot.length, slot.offset);
+                transform_timer.finish(slot.length);
+                slot.done = 0;
+                slot.issued = StageProfiler::Clock::now();
+                queue_io(index, true);
+                continue;
+            }
+
+            bytes_processed += slot.length;
+            if (!failed && next_offset < file_size)
+            {
+                start_read(index);
+            }
+            else
+            {
+                --busy_slots;
+            }
+        }
+    }
+
+    return !failed;
+#else
+    return stream_transform_file(input_filename, output_filename, engine, buffer_size, bytes_processed);
+#endif
+}
+
+/// <summary>
+/// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+/// The producer only writes the tail and the consumer only writes the head, each on its
+/// own cache line, so handing an item over costs two atomic stores and no locks.
+/// </summary>
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+        : m_slots(std::bit_ceil(std::max<size_t>(capacity, 2))),
+          m_mask(m_slots.size() - 1)
+    {
+    }
+
+    bool try_push(const T& value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == m_slots.size())
+        {
+            return false;
+        }
+        m_slots[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// <summary>
+    /// Pops, waiting for an item if the queue is empty. The wait spins briefly, then yields,
+    /// then sleeps, so a stage blocked on a slow disk does not burn a core.
+    /// </summary>
+    T pop()
+    {
+        T value;
+        for (unsigned attempt = 0; !try_pop(value); ++attempt)
+        {
+            if (attempt < 64)
+            {
+                continue;
+            }
+            if (attempt < 256)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        return value;
+    }
+
+private:
+    std::vector<T> m_slots;
+    const size_t m_mask;
+    alignas(64) std::atomic<size_t> m_head{ 0 };
+    alignas(64) std::atomic<size_t> m_tail{ 0 };
+};
+
+/// <summary>
+/// Encrypts or decrypts a file with three overlapping stages: a reader thread fills pooled
+/// chunks, transform workers encrypt them, and a writer thread writes them out in order. The
+/// stages are connected by SpscQueues. Chunks are dealt to the workers round-robin and
+/// collected in the same order, so the output order is preserved without sorting, and the
+/// writer hands each written chunk straight back to the reader. Every queue can hold the
+/// whole pool, so a push never blocks and a failing stage cannot deadlock the others.
+/// End-to-end time approaches the slower of reading and writing rather than their sum.
+/// </summary>
+/// <param name="input_filename">File to read (plaintext or ciphertext)</param>
+/// <param name="output_filename">File to write; overwritten if it exists</param>
+/// <param name="cipher">The keyed cipher; shared read-only by the workers</param>
+/// <param name="chunk_size">Size of each pooled chunk</param>
+/// <param name="worker_count">Number of transform threads</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole input was transformed and written</returns>
+template <StreamCipher Cipher>
+bool pipeline_transform_file(const std::string& input_filename, const std::string& output_filename,
+                             const Cipher& cipher, size_t chunk_size, unsigned worker_count,
+                             uint64_t& bytes_processed)
+{
+    assert(chunk_size > 0 && worker_count > 0);
+    bytes_processed = 0;
+
+    StageTimer open_timer("open");
+    std::ifstream input_file_stream(input_filename, std::ios::in | std::ios::binary);
+    if (!input_file_stream)
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+
+    std::ofstream output_file_stream(output_filename, std::ios::out | std::ios::binary);
+    if (!output_file_stream)
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    struct Chunk
+    {
+        BufferArena::Buffer data;
+        size_t length = 0;
+        uint64_t offset = 0;
+    };
+
+    // Two chunks per worker keep every worker busy while the reader and writer each hold one
+    const size_t chunk_count = 2 * static_cast<size_t>(worker_count) + 2;
+    const size_t end_of_stream = SIZE_MAX;
+    std::vector<Chunk> chunks(chunk_count);
+
+    SpscQueue<size_t> free_chunks(chunk_count);
+    for (size_t i = 0; i < chunk_count; ++i)
+    {
+        chunks[i].data = BufferArena::local().acquire(chunk_size);
+        free_chunks.try_push(i);
+    }
+
+    std::vector<std::unique_ptr<SpscQueue<size_t>>> to_workers;
+    std::vector<std::unique_ptr<SpscQueue<size_t>>> from_workers;
+    for (unsigned w = 0; w < worker_count; ++w)
+    {
+        to_workers.push_back(std::make_unique<SpscQueue<size_t>>(chunk_count + 1));
+        from_workers.push_back(std::make_unique<SpscQueue<size_t>>(chunk_count + 1));
+    }
+
+    std::atomic<bool> failed{ false };
+
+    std::thread reader([&] {
+        for (size_t sequence = 0;; ++sequence)
+        {
+            const size_t index = free_chunks.pop();
+            Chunk& chunk = chunks[index];
+            if (!failed.load(std::memory_order_relaxed))
+            {
+                StageTimer read_timer("read");
+                input_file_stream.read(reinterpret_cast<char*>(chunk.data.get()), static_cast<std::streamsize>(chunk_size));
+                chunk.length = static_cast<size_t>(input_file_stream.gcount());
+                read_timer.finish(chunk.length);
+                if (input_file_stream.bad())
+                {
+                    std::cerr << "Error reading file: " << input_filename << std::endl;
+                    failed.store(true);
+                }
+            }
+
+            if (failed.load(std::memory_order_relaxed) || chunk.length == 0)
+            {
+                // Tell every worker, in dealing order, that the stream has ended. The chunk is
+                // not pushed back: the writer is free_chunks' only producer, and nothing reads
+                // into it again
+                for (unsigned w = 0; w < worker_count; ++w)
+                {
+                    to_workers[(sequence + w) % worker_count]->try_push(end_of_stream);
+                }
+                return;
+            }
+
+            chunk.offset = static_cast<uint64_t>(sequence) * chunk_size;
+            to_workers[sequence % worker_count]->try_push(index);
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w)
+    {
+        workers.emplace_back([&, w] {
+            for (;;)
+            {
+                const size_t index = to_workers[w]->pop();
+                if (index != end_of_stream)
+                {
+                    Chunk& chunk = chunks[index];
+                    StageTimer transform_timer("transform");
+                    cipher.apply(chunk.data.get(), chunk.data.get(), chunk.length, chunk.offset);
+                    transform_timer.finish(chunk.length);
+                }
+                from_workers[w]->try_push(index);
+                if (index == end_of_stream)
+                {
+                    return;
+                }
+            }
+        });
+    }
+
+    // The writer runs on the calling thread, taking chunks back in the order they were dealt
+    for (size_t sequence = 0;; ++sequence)
+    {
+        const size_t index = from_workers[sequence % worker_count]->pop();
+        if (index == end_of_stream)
+        {
+            break;
+        }
+
+        const Chunk& chunk = chunks[index];
+        if (!failed.load(std::memory_order_relaxed))
+        {
+            StageTimer write_timer("write");
+            if (output_file_stream.write(reinterpret_cast<const char*>(chunk.data.get()), static_cast<std::streamsize>(chunk.length)))
+            {
+                write_timer.finish(chunk.length);
+                bytes_processed += chunk.length;
+            }
+            else
+            {
+                std::cerr << "Error writing to file: " << output_filename << std::endl;
+                failed.store(true);
+            }
+        }
+        free_chunks.try_push(index);
+    }
+
+    reader.join();
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    return !failed.load();
+}
+
+// O_DIRECT transfers must start at, and be a multiple of, the device's logical block size,
+// in memory and in the file. 4096 covers both 512-byte and 4K-sector devices.
+const size_t direct_io_alignment = 4096;
+
+/// <summary>
+/// A file read or written around the page cache: O_DIRECT on Linux, F_NOCACHE on macOS and
+/// FILE_FLAG_NO_BUFFERING on Windows. Every transfer must be a multiple of
+/// direct_io_alignment from an aligned buffer; the last block of a file is written padded
+/// and the padding cut off again with truncate. On file systems that refuse O_DIRECT, such
+/// as tmpfs, the file is opened normally and bypasses_cache() reports false.
+/// </summary>
+class DirectFile
+{
+public:
+    DirectFile() = default;
+    ~DirectFile()
+    {
+        close();
+    }
+
+    DirectFile(const DirectFile&) = delete;
+    DirectFile& operator=(const DirectFile&) = delete;
+
+    bool open_read(const std::string& filename)
+    {
+        return open(filename, false);
+    }
+
+    bool create(const std::string& filename)
+    {
+        return open(filename, true);
+    }
+
+    bool bypasses_cache() const
+    {
+        return m_bypasses_cache;
+    }
+
+    /// <summary>
+    /// Reads until buffer is full or the file ends. The file ends with the first transfer
+    /// that is not a whole number of blocks, so a short count means the end of the file.
+    /// </summary>
+    /// <param name="count">Receives the number of bytes read</param>
+    /// <returns>False on a read error</returns>
+    bool read(unsigned char* buffer, size_t capacity, size_t& count)
+    {
+        count = 0;
+        while (count < capacity)
+        {
+#if defined(_WIN32)
+            DWORD transferred = 0;
+            if (!ReadFile(m_handle, buffer + count, static_cast<DWORD>(std::min<size_t>(capacity - count, 1u << 30)),
+                          &transferred, nullptr))
+            {
+                return false;
+            }
+#else
+            const ssize_t transferred = ::read(m_fd, buffer + count, capacity - count);
+            if (transferred < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (transferred < 0)
+            {
+                return false;
+            }
+#endif
+            count += static_cast<size_t>(transferred);
+            if (transferred == 0 || count % direct_io_alignment != 0)
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Writes all of buffer. length must be a multiple of direct_io_alignment.
+    /// </summary>
+    bool write(const unsigned char* buffer, size_t length)
+    {
+        assert(length % direct_io_alignment == 0);
+        while (length > 0)
+        {
+#if defined(_WIN32)
+            DWORD transferred = 0;
+            if (!WriteFile(m_handle, buffer, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)), &transferred, nullptr))
+            {
+                return false;
+            }
+#else
+            const ssize_t transferred = ::write(m_fd, buffer, length);
+            if (transferred < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (transferred <= 0)
+            {
+                return false;
+            }
+#endif
+            buffer += transferred;
+            length -= static_cast<size_t>(transferred);
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Sets the file's length, cutting off the padding of the last written block.
+    /// </summary>
+    bool truncate(uint64_t size)
+    {
+#if defined(_WIN32)
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(size);
+        return SetFilePointerEx(m_handle, position, nullptr, FILE_BEGIN) && SetEndOfFile(m_handle);
+#else
+        return ::ftruncate(m_fd, static_cast<off_t>(size)) == 0;
+#endif
+    }
+
+    bool close()
+    {
+#if defined(_WIN32)
+        const bool closed = m_handle == INVALID_HANDLE_VALUE || CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+#else
+        const bool closed = m_fd < 0 || ::close(m_fd) == 0;
+        m_fd = -1;
+#endif
+        return closed;
+    }
+
+private:
+    bool open(const std::string& filename, bool for_writing)
+    {
+        close();
+#if defined(_WIN32)
+        m_handle = CreateFileA(filename.c_str(), for_writing ? GENERIC_WRITE : GENERIC_READ,
+                               for_writing ? 0 : FILE_SHARE_READ, nullptr, for_writing ? CREATE_ALWAYS : OPEN_EXISTING,
+                               FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        m_bypasses_cache = true;
+        return m_handle != INVALID_HANDLE_VALUE;
+#else
+        const int flags = for_writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+        m_bypasses_cache = false;
+#if defined(O_DIRECT)
+        m_fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+        if (m_fd >= 0)
+        {
+            m_bypasses_cache = true;
+            return true;
+        }
+        if (errno != EINVAL)
+        {
+            return false;
+        }
+#endif
+        m_fd = ::open(filename.c_str(), flags, 0644);
+#if defined(F_NOCACHE)
+        m_bypasses_cache = m_fd >= 0 && fcntl(m_fd, F_NOCACHE, 1) == 0;
+#endif
+        return m_fd >= 0;
+#endif
+    }
+
+#if defined(_WIN32)
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+#else
+    int m_fd = -1;
+#endif
+    bool m_bypasses_cache = false;
+};
+
+/// <summary>
+/// Encrypts or decrypts a file without going through the page cache, so bulk encryption of
+/// a huge file does not evict the cached pages other programs on the host depend on. A
+/// reader thread fills a pool of aligned buffers while the calling thread transforms and
+/// writes the previous ones, since without the kernel's readahead nothing else overlaps the
+/// device with the transform. The last buffer is padded with zeros to a whole block for the
+/// write and the output truncated to the input's length afterwards.
+/// </summary>
+/// <param name="input_filename">File to read (plaintext or ciphertext)</param>
+/// <param name="output_filename">File to write; overwritten if it exists</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="buffer_size">Size of each pooled buffer; rounded up to whole blocks</param>
+/// <param name="buffer_count">Number of pooled buffers</param>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if the whole input was transformed and written</returns>
+template <typename Engine>
+bool direct_transform_file(const std::string& input_filename, const std::string& output_filename,
+                           Engine& engine, size_t buffer_size, unsigned buffer_count, uint64_t& bytes_processed)
+{
+    assert(buffer_size > 0);
+    bytes_processed = 0;
+    buffer_size = (buffer_size + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+    buffer_count = std::max(2u, buffer_count);
+
+    StageTimer open_timer("open");
+    DirectFile input;
+    if (!input.open_read(input_filename))
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+    DirectFile output;
+    if (!output.create(output_filename))
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+    if (!input.bypasses_cache() || !output.bypasses_cache())
+    {
+        std::cerr << "The file system does not support direct I/O; "
+                  << (input.bypasses_cache() ? output_filename : input_filename) << " goes through the page cache"
+                  << std::endl;
+    }
+
+    static_assert(arena_alignment % direct_io_alignment == 0, "arena buffers must suit O_DIRECT");
+    const BufferArena::Buffer storage = BufferArena::local().acquire(buffer_size * buffer_count);
+
+    struct Filled
+    {
+        size_t index;
+        size_t length; // less than buffer_size only for the last buffer
+    };
+    const size_t end_of_stream = SIZE_MAX;
+
+    SpscQueue<size_t> free_buffers(buffer_count);
+    SpscQueue<Filled> filled_buffers(buffer_count + 1);
+    for (size_t i = 0; i < buffer_count; ++i)
+    {
+        free_buffers.try_push(i);
+    }
+
+    std::atomic<bool> failed{ false };
+
+    std::thread reader([&] {
+        for (;;)
+        {
+            const size_t index = free_buffers.pop();
+            size_t length = 0;
+            if (!failed.load(std::memory_order_relaxed))
+            {
+                StageTimer read_timer("read");
+                if (input.read(storage.get() + index * buffer_size, buffer_size, length))
+                {
+                    read_timer.finish(length);
+                }
+                else
+                {
+                    std::cerr << "Error reading file: " << input_filename << std::endl;
+                    failed.store(true);
+                }
+            }
+
+            if (failed.load(std::memory_order_relaxed) || length == 0)
+            {
+                filled_buffers.try_push(Filled{ end_of_stream, 0 });
+                return;
+            }
+            filled_buffers.try_push(Filled{ index, length });
+            if (length < buffer_size)
+            {
+                filled_buffers.try_push(Filled{ end_of_stream, 0 });
+                return;
+            }
+        }
+    });
+
+    for (;;)
+    {
+        const Filled filled = filled_buffers.pop();
+        if (filled.index == end_of_stream)
+        {
+            break;
+        }
+
+        unsigned char* const buffer = storage.get() + filled.index * buffer_size;
+        if (!failed.load(std::memory_order_relaxed))
+        {
+            StageTimer transform_timer("transform");
+            engine.transform(buffer, buffer, filled.length, bytes_processed);
+            transform_timer.finish(filled.length);
+
+            StageTimer write_timer("write");
+            const size_t padded = (filled.length + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+            std::memset(buffer + filled.length, 0, padded - filled.length);
+            if (output.write(buffer, padded))
+            {
+                write_timer.finish(filled.length);
+                bytes_processed += filled.length;
+            }
+            else
+            {
+                std::cerr << "Error writing to file: " << output_filename << std::endl;
+                failed.store(true);
+            }
+        }
+        free_buffers.try_push(filled.index);
+    }
+    reader.join();
+
+    StageTimer close_timer("write");
+    if (!failed.load() && (!output.truncate(bytes_processed) || !output.close()))
+    {
+        std::cerr << "Error writing to file: " << output_filename << std::endl;
+        return false;
+    }
+    return !failed.load();
+}
+
+/// <summary>
+/// Fills buffer from standard input, reading until it is full or the input ends, since a
+/// pipe returns whatever happens to be in it.
+/// </summary>
+/// <param name="filled">Receives the number of bytes read; 0 at the end of the input</param>
+/// <returns>False on a read error</returns>
+bool read_standard_input(unsigned char* buffer, size_t capacity, size_t& filled)
+{
+    filled = 0;
+    while (filled < capacity)
+    {
+#if defined(_WIN32)
+        DWORD count = 0;
+        if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buffer + filled,
+                      static_cast<DWORD>(std::min<size_t>(capacity - filled, 1u << 30)), &count, nullptr))
+        {
+            // The writing end of a pipe closing is the end of the input, not an error
+            return GetLastError() == ERROR_BROKEN_PIPE;
+        }
+#else
+        const ssize_t count = ::read(STDIN_FILENO, buffer + filled, capacity - filled);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            return false;
+        }
+#endif
+        if (count == 0)
+        {
+            break;
+        }
+        filled += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+/// <summary>
+/// Writes all of buffer to standard output.
+/// </summary>
+/// <returns>True if every byte was written</returns>
+bool write_standard_output(const unsigned char* buffer, size_t length)
+{
+    while (length > 0)
+    {
+#if defined(_WIN32)
+        DWORD count = 0;
+        if (!WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), buffer, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)),
+                       &count, nullptr))
+        {
+            return false;
+        }
+#else
+        const ssize_t count = ::write(STDOUT_FILENO, buffer, length);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+#endif
+        buffer += count;
+        length -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+/// <summary>
+/// Filter mode: encrypts or decrypts standard input to standard output, buffer_size bytes at
+/// a time, so the tool can sit in a pipeline such as tar c dir | ... | ssh host. Input is
+/// read into one buffer, transformed in place and written out with write, which copies it
+/// into the pipe, so the buffer can be refilled as soon as the write returns. (vmsplice
+/// would save that copy, but the pipe's reader may splice the pages onward and still
+/// reference them after they leave our pipe, so the buffer could never be reused.)
+/// </summary>
+/// <param name="bytes_processed">Receives the number of bytes transformed</param>
+/// <returns>True if all of standard input was transformed and written</returns>
+template <typename Engine>
+bool pipe_transform(Engine& engine, size_t buffer_size, uint64_t& bytes_processed)
+{
+    bytes_processed = 0;
+
+#if defined(__linux__)
+    struct stat info;
+    if (fstat(STDOUT_FILENO, &info) == 0 && S_ISFIFO(info.st_mode))
+    {
+        // Ask for a pipe that holds a whole buffer, so a write rarely has to wait for the
+        // reader part way; unprivileged processes may get less
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, static_cast<int>(std::min<size_t>(buffer_size, 1u << 20)));
+    }
+#endif
+
+    const BufferArena::Buffer storage = BufferArena::local().acquire(buffer_size);
+    unsigned char* const buffer = storage.get();
+    for (;;)
+    {
+        StageTimer read_timer("read");
+        size_t length = 0;
+        if (!read_standard_input(buffer, buffer_size, length))
+        {
+            std::cerr << "Error reading standard input" << std::endl;
+            return false;
+        }
+        read_timer.finish(length);
+        if (length == 0)
+        {
+            return true;
+        }
+
+        StageTimer transform_timer("transform");
+        engine.transform(buffer, buffer, length, bytes_processed);
+        transform_timer.finish(length);
+
+        StageTimer write_timer("write");
+        if (!write_standard_output(buffer, length))
+        {
+            std::cerr << "Error writing to standard output" << std::endl;
+            return false;
+        }
+        write_timer.finish(length);
+        bytes_processed += length;
+    }
+}
+
+/// <summary>
+/// Returns the index of the first byte where a and b differ, or length if they are equal.
+/// Uses 16-byte SSE2 compares on x86 and 64-bit words elsewhere.
+/// </summary>
+size_t find_first_difference(const unsigned char* a, const unsigned char* b, size_t length)
+{
+    size_t i = 0;
+#if defined(ENCRYPTION_X86)
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const auto equal_mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+        if (equal_mask != 0xFFFFu)
+        {
+            return i + static_cast<size_t>(std::countr_zero(~equal_mask));
+        }
+    }
+#else
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t wa;
+        uint64_t wb;
+        std::memcpy(&wa, a + i, sizeof(wa));
+        std::memcpy(&wb, b + i, sizeof(wb));
+        if (wa != wb)
+        {
+            break;
+        }
+    }
+#endif
+    for (; i < length; ++i)
+    {
+        if (a[i] != b[i])
+        {
+            return i;
+        }
+    }
+    return length;
+}
+
+/// <summary>
+/// Outcome of comparing two files.
+/// </summary>
+enum class CompareResult
+{
+    identical,
+    size_mismatch,
+    content_mismatch,
+    error
+};
+
+// Block size used by the streaming comparison, per file
+const size_t compare_block_size = 1 << 20;
+
+/// <summary>
+/// Compares two files block by block without loading either into memory. The sizes are
+/// checked first, then each pair of blocks is compared with memcmp and the scan stops at
+/// the first block that differs.
+/// </summary>
+/// <param name="file1">Path to the first file</param>
+/// <param name="file2">Path to the second file</param>
+/// <param name="size1">Receives the size of the first file</param>
+/// <param name="size2">Receives the size of the second file</param>
+/// <param name="mismatch_offset">Receives the offset of the first differing byte on content_mismatch</param>
+/// <returns>How the files compare, or error if either could not be read</returns>
+CompareResult compare_file_contents(const std::string& file1, const std::string& file2,
+                                    uint64_t& size1, uint64_t& size2, uint64_t& mismatch_offset)
+{
+    mismatch_offset = 0;
+
+    std::ifstream stream1(file1, std::ios::in | std::ios::binary | std::ios::ate);
+    std::ifstream stream2(file2, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!stream1 || !stream2)
+    {
+        std::cerr << "Unable to open file: " << (!stream1 ? file1 : file2) << std::endl;
+        return CompareResult::error;
+    }
+
+    size1 = static_cast<uint64_t>(stream1.tellg());
+    size2 = static_cast<uint64_t>(stream2.tellg());
+    if (size1 != size2)
+    {
+        return CompareResult::size_mismatch;
+    }
+    stream1.seekg(0);
+    stream2.seekg(0);
+
+    const BufferArena::Buffer arena_block1 = BufferArena::local().acquire(compare_block_size);
+    const BufferArena::Buffer arena_block2 = BufferArena::local().acquire(compare_block_size);
+    char* const block1 = reinterpret_cast<char*>(arena_block1.get());
+    char* const block2 = reinterpret_cast<char*>(arena_block2.get());
+
+    for (uint64_t offset = 0; offset < size1;)
+    {
+        const auto length = static_cast<size_t>(std::min<uint64_t>(compare_block_size, size1 - offset));
+        if (!stream1.read(block1, static_cast<std::streamsize>(length)) ||
+            !stream2.read(block2, static_cast<std::streamsize>(length)))
+        {
+            std::cerr << "Error reading " << (!stream1 ? file1 : file2) << " at offset " << offset << std::endl;
+            return CompareResult::error;
+        }
+
+        if (std::memcmp(block1, block2, length) != 0)
+        {
+            mismatch_offset = offset + find_first_difference(arena_block1.get(), arena_block2.get(), length);
+            return CompareResult::content_mismatch;
+        }
+        offset += length;
+    }
+
+    return CompareResult::identical;
+}
+
+/// <summary>
+/// Compares the contents of two files and checks for exact byte-by-byte match.
+/// Used to verify the decrypted file matches the original input file.
+/// Memory use is constant; on a mismatch the offset of the first differing byte is reported.
+/// </summary>
+/// <param name="file1">Path to the original file</param>
+/// <param name="file2">Path to the decrypted file</param>
+/// <returns>True if files are identical, false otherwise</returns>
+bool compare_files(const std::string& file1, const std::string& file2)
+{
+    uint64_t size1 = 0;
+    uint64_t size2 = 0;
+    uint64_t mismatch_offset = 0;
+
+    StageTimer compare_timer("compare");
+    const CompareResult result = compare_file_contents(file1, file2, size1, size2, mismatch_offset);
+    compare_timer.finish(size1);
+
+    switch (result)
+    {
+    case CompareResult::identical:
+        std::cout << "SUCCESS: Decrypted file matches original input.\n";
+        return true;
+    case CompareResult::size_mismatch:
+        std::cout << "ERROR: Decrypted file does NOT match the original input (sizes differ: "
+                  << size1 << " vs " << size2 << " bytes).\n";
+        return false;
+    case CompareResult::content_mismatch:
+        std::cout << "ERROR: Decrypted file does NOT match the original input (first difference at byte "
+                  << mismatch_offset << ").\n";
+        return false;
+    default:
+        std::cerr << "Error: One or both files could not be read for comparison.\n";
+        return false;
+    }
+}
+
+/// <summary>
+/// Totals from a fused encrypt-and-verify pass.
+/// </summary>
+struct FusedVerifyResult
+{
+    uint64_t bytes_processed = 0;
+    uint64_t plaintext_checksum = 0;
+    uint64_t round_trip_checksum = 0;
+};
+
+/// <summary>
+/// Encrypts a file and proves the ciphertext decrypts back to the input in a single
+/// streaming pass. Each block is hashed as plaintext, encrypted into a second buffer and
+/// written, then decrypted back into the first buffer and hashed again. The two running
+/// checksums must agree at the end. The input is read once and the ciphertext is written
+/// once; nothing is reread from disk.
+/// </summary>
+/// <param name="input_filename">Plaintext file to encrypt</param>
+/// <param name="encrypted_filename">Where to write the ciphertext</param>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="buffer_size">Size of each of the two working buffers</param>
+/// <param name="result">Receives the byte count and both checksums</param>
+/// <returns>True if the ciphertext was written and the checksums match</returns>
+template <typename Engine>
+bool fused_encrypt_verify(const std::string& input_filename, const std::string& encrypted_filename,
+                          Engine& engine, size_t buffer_size, FusedVerifyResult& result)
+{
+    assert(buffer_size > 0);
+    result = FusedVerifyResult();
+
+    StageTimer open_timer("open");
+    std::ifstream input_file_stream(input_filename, std::ios::in | std::ios::binary);
+    if (!input_file_stream)
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+
+    std::ofstream output_file_stream(encrypted_filename, std::ios::out | std::ios::binary);
+    if (!output_file_stream)
+    {
+        std::cerr << "Unable to open file for writing: " << encrypted_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    const BufferArena::Buffer plaintext = BufferArena::local().acquire(buffer_size);
+    const BufferArena::Buffer ciphertext = BufferArena::local().acquire(buffer_size);
+    Xxh64 plaintext_hash;
+    Xxh64 round_trip_hash;
+
+    while (input_file_stream)
+    {
+        StageTimer read_timer("read");
+        input_file_stream.read(reinterpret_cast<char*>(plaintext.get()), static_cast<std::streamsize>(buffer_size));
+        const auto count = static_cast<size_t>(input_file_stream.gcount());
+        read_timer.finish(count);
+        if (count == 0)
+        {
+            break;
+        }
+
+        StageTimer transform_timer("transform");
+        plaintext_hash.update(plaintext.get(), count);
+        engine.transform(ciphertext.get(), plaintext.get(), count, result.bytes_processed);
+        transform_timer.finish(count);
+
+        StageTimer write_timer("write");
+        if (!output_file_stream.write(reinterpret_cast<const char*>(ciphertext.get()), static_cast<std::streamsize>(count)))
+        {
+            std::cerr << "Error writing to file: " << encrypted_filename << std::endl;
+            return false;
+        }
+        write_timer.finish(count);
+
+        // Decrypt what was just written over the plaintext buffer, which is no longer needed
+        StageTimer verify_timer("verify");
+        engine.transform(plaintext.get(), ciphertext.get(), count, result.bytes_processed);
+        round_trip_hash.update(plaintext.get(), count);
+        verify_timer.finish(count);
+        result.bytes_processed += count;
+    }
+
+    if (input_file_stream.bad())
+    {
+        std::cerr << "Error reading file: " << input_filename << std::endl;
+        return false;
+    }
+
+    StageTimer close_timer("write");
+    output_file_stream.close();
+    close_timer.finish();
+    if (!output_file_stream)
+    {
+        std::cerr << "Error writing to file: " << encrypted_filename << std::endl;
+        return false;
+    }
+
+    result.plaintext_checksum = plaintext_hash.digest();
+    result.round_trip_checksum = round_trip_hash.digest();
+    return result.plaintext_checksum == result.round_trip_checksum;
+}
+
+/// <summary>
+/// Outcome of encrypting one file in batch mode.
+/// </summary>
+struct BatchFileResult
+{
+    std::string relative_path;
+    uint64_t bytes = 0;
+    bool succeeded = false;
+    double milliseconds = 0.0;
+};
+
+/// <summary>
+/// Encrypts every regular file under source_root into the same relative path under
+/// destination_root. Directories are walked in parallel: each directory is a pool task that
+/// queues one task per file and one per subdirectory, so files start encrypting while the
+/// rest of the tree is still being listed. Symbolic links to directories are not followed,
+/// since a link to an ancestor would make the walk endless; destination_root must not lie
+/// inside source_root (see run_batch), or the outputs would be walked as inputs.
+/// </summary>
+/// <param name="source_root">Directory tree to encrypt</param>
+/// <param name="destination_root">Root of the mirrored output tree; created if missing</param>
+/// <param name="engine">Single-threaded engine shared by all workers</param>
+/// <param name="buffer_size">Largest stream buffer used for one file</param>
+/// <param name="thread_count">Number of pool workers</param>
+/// <param name="sync_output">Flush each output file to disk before counting it as done</param>
+/// <param name="direct_io">Read and write around the page cache with direct_transform_file</param>
+/// <returns>One result per file, sorted by path</returns>
+template <typename Engine>
+std::vector<BatchFileResult> encrypt_directory_tree(const std::filesystem::path& source_root,
+                                                   const std::filesystem::path& destination_root,
+                                                   Engine& engine, size_t buffer_size,
+                                                   unsigned thread_count, bool sync_output, bool direct_io)
+{
+    assert(engine.thread_count() == 1);
+
+    std::vector<BatchFileResult> results;
+    std::mutex results_mutex;
+    WorkStealingPool pool(thread_count);
+
+    const auto record = [&](BatchFileResult result) {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        results.push_back(std::move(result));
+    };
+
+    const auto encrypt_one = [&](const std::filesystem::path& source, uint64_t size) {
+        const auto start = std::chrono::steady_clock::now();
+        BatchFileResult result;
+        result.relative_path = source.lexically_relative(source_root).generic_string();
+
+        // Small files get a buffer their own size rather than the full stream buffer
+        const auto file_buffer = static_cast<size_t>(std::clamp<uint64_t>(size, 1, buffer_size));
+        const std::filesystem::path destination = destination_root / source.lexically_relative(source_root);
+        const bool written = direct_io
+            ? direct_transform_file(source.string(), destination.string(), engine, file_buffer, 2, result.bytes)
+            : stream_transform_file(source.string(), destination.string(), engine, file_buffer, result.bytes);
+        result.succeeded = written && (!sync_output || sync_file(destination.string()));
+
+        result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        record(std::move(result));
+    };
+
+    std::function<void(const std::filesystem::path&)> visit_directory = [&](const std::filesystem::path& directory) {
+        std::error_code error;
+        std::filesystem::create_directories(destination_root / directory.lexically_relative(source_root), error);
+
+        std::filesystem::directory_iterator entries(directory, error);
+        if (error)
+        {
+            BatchFileResult result;
+            result.relative_path = directory.lexically_relative(source_root).generic_string() + "/";
+            record(std::move(result));
+            std::cerr << "Unable to list directory: " << directory.string() << " (" << error.message() << ")\n";
+            return;
+        }
+
+        for (const std::filesystem::directory_entry& entry : entries)
+        {
+            if (entry.is_symlink(error) && entry.is_directory(error))
+            {
+                std::cerr << "Skipping symbolic link to directory: " << entry.path().string() << "\n";
+            }
+            else if (entry.is_directory(error))
+            {
+                const std::filesystem::path subdirectory = entry.path();
+                pool.submit([&visit_directory, subdirectory] { visit_directory(subdirectory); });
+            }
+            else if (entry.is_regular_file(error))
+            {
+                const std::filesystem::path file = entry.path();
+                const uint64_t size = entry.file_size(error);
+                pool.submit([&encrypt_one, file, size] { encrypt_one(file, size); });
+            }
+        }
+    };
+
+    pool.submit([&] { visit_directory(source_root); });
+    pool.wait_idle();
+
+    std::sort(results.begin(), results.end(), [](const BatchFileResult& a, const BatchFileResult& b) {
+        return a.relative_path < b.relative_path;
+    });
+    return results;
+}
+
+/// <summary>
+/// Writes the per-file batch results as CSV: path, bytes, status, milliseconds.
+/// </summary>
+/// <returns>True if the summary file was written</returns>
+bool write_batch_summary(const std::string& filename, const std::vector<BatchFileResult>& results)
+{
+    std::ofstream summary(filename, std::ios::out | std::ios::binary);
+    if (!summary)
+    {
+        std::cerr << "Unable to open file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    summary << "path,bytes,status,milliseconds\n";
+    for (const BatchFileResult& result : results)
+    {
+        // Quote paths so commas and quotes in file names cannot break the columns
+        std::string quoted = "\"";
+        for (char c : result.relative_path)
+        {
+            quoted += c;
+            if (c == '"')
+            {
+                quoted += '"';
+            }
+        }
+        quoted += '"';
+
+        summary << quoted << ',' << result.bytes << ',' << (result.succeeded ? "ok" : "failed") << ','
+                << std::fixed << std::setprecision(3) << result.milliseconds << '\n';
+    }
+    return static_cast<bool>(summary);
+}
+
+/// <summary>
+/// Which stream cipher encrypts the data.
+/// </summary>
+enum class CipherKind
+{
+    xor_key,  // the original repeating-key XOR; fast, but not secure
+    chacha20, // ChaCha20 keyed with SHA-256 of the passphrase
+    aes256_ctr // AES-256-CTR keyed with SHA-256 of the passphrase
+};
+
+/// <summary>
+/// One buffer of a gathered write.
+/// </summary>
+struct ConstBuffer
+{
+    const void* data;
+    size_t length;
+};
+
+/// <summary>
+/// A file opened for positioned reads, or created for sequential gathered writes. It works
+/// on the native handle (a POSIX descriptor or a Win32 HANDLE) rather than a stream, so a
+/// read goes straight to its offset without a seek and several buffers leave in one call:
+/// writev on POSIX systems, and one WriteFile per buffer on Windows, which has no
+/// gathered write for ordinary buffered files.
+/// </summary>
+class RandomAccessFile
+{
+public:
+    RandomAccessFile() = default;
+    ~RandomAccessFile() { close(); }
+
+    RandomAccessFile(const RandomAccessFile&) = delete;
+    RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+    bool open_read(const std::string& filename)
+    {
+        close();
+#if defined(_WIN32)
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (m_fd < 0 || fstat(m_fd, &info) != 0)
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    /// <summary>
+    /// Creates or truncates a file for writing. size() then counts the bytes written.
+    /// </summary>
+    bool create(const std::string& filename)
+    {
+        close();
+#if defined(_WIN32)
+        m_file = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                             FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        const bool created = m_file != INVALID_HANDLE_VALUE;
+#else
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        const bool created = m_fd >= 0;
+#endif
+        m_size = 0;
+        return created;
+    }
+
+    /// <summary>
+    /// Opens a file for reading and writing in place, creating it if it does not exist.
+    /// Nothing is truncated; size() is the file's current length.
+    /// </summary>
+    bool open_update(const std::string& filename)
+    {
+        close();
+#if defined(_WIN32)
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(size.QuadPart);
+#else
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat info;
+        if (m_fd < 0 || fstat(m_fd, &info) != 0)
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<uint64_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    uint64_t size() const { return m_size; }
+
+    /// <summary>
+    /// Reads exactly length bytes starting at offset.
+    /// </summary>
+    /// <returns>False on an error or if the file ends first</returns>
+    bool read_at(void* buffer, size_t length, uint64_t offset) const
+    {
+        auto* bytes = static_cast<unsigned char*>(buffer);
+        while (length > 0)
+        {
+#if defined(_WIN32)
+            OVERLAPPED position = {};
+            position.Offset = static_cast<DWORD>(offset);
+            position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD count = 0;
+            if (!ReadFile(m_file, bytes, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)), &count, &position) ||
+                count == 0)
+            {
+                return false;
+            }
+#else
+            const ssize_t count = ::pread(m_fd, bytes, length, static_cast<off_t>(offset));
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+#endif
+            bytes += count;
+            length -= static_cast<size_t>(count);
+            offset += static_cast<uint64_t>(count);
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Appends the buffers, in order, at the end of what has been written so far. Partial
+    /// writes are resumed, so either every byte is written or false is returned.
+    /// </summary>
+    bool write_gathered(std::span<const ConstBuffer> buffers)
+    {
+#if defined(_WIN32)
+        for (const ConstBuffer& buffer : buffers)
+        {
+            const auto* bytes = static_cast<const unsigned char*>(buffer.data);
+            for (size_t done = 0; done < buffer.length;)
+            {
+                DWORD count = 0;
+                if (!WriteFile(m_file, bytes + done, static_cast<DWORD>(std::min<size_t>(buffer.length - done, 1u << 30)),
+                               &count, nullptr))
+                {
+                    return false;
+                }
+                done += count;
+                m_size += count;
+            }
+        }
+        return true;
+#else
+        std::vector<iovec> pending;
+        pending.reserve(buffers.size());
+        for (const ConstBuffer& buffer : buffers)
+        {
+            if (buffer.length > 0)
+            {
+                pending.push_back(iovec{ const_cast<void*>(buffer.data), buffer.length });
+            }
+        }
+
+        const long iov_limit = sysconf(_SC_IOV_MAX);
+        const size_t max_buffers = iov_limit > 0 ? static_cast<size_t>(iov_limit) : 16;
+        size_t first = 0;
+        while (first < pending.size())
+        {
+            const auto count = static_cast<int>(std::min(pending.size() - first, max_buffers));
+            const ssize_t written = ::writev(m_fd, pending.data() + first, count);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+
+            // Drop the buffers that went out completely and trim the one that went out in part
+            auto remaining = static_cast<size_t>(written);
+            m_size += remaining;
+            while (first < pending.size() && remaining >= pending[first].iov_len)
+            {
+                remaining -= pending[first].iov_len;
+                ++first;
+            }
+            if (remaining > 0)
+            {
+                pending[first].iov_base = static_cast<unsigned char*>(pending[first].iov_base) + remaining;
+                pending[first].iov_len -= remaining;
+            }
+        }
+        return true;
+#endif
+    }
+
+    /// <summary>
+    /// Writes all of buffer at offset, leaving the rest of the file as it is.
+    /// </summary>
+    bool write_at(const void* buffer, size_t length, uint64_t offset)
+    {
+        const auto* bytes = static_cast<const unsigned char*>(buffer);
+        while (length > 0)
+        {
+#if defined(_WIN32)
+            OVERLAPPED position = {};
+            position.Offset = static_cast<DWORD>(offset);
+            position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD count = 0;
+            if (!WriteFile(m_file, bytes, static_cast<DWORD>(std::min<size_t>(length, 1u << 30)), &count, &position))
+            {
+                return false;
+            }
+#else
+            const ssize_t count = ::pwrite(m_fd, bytes, length, static_cast<off_t>(offset));
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+#endif
+            bytes += count;
+            length -= static_cast<size_t>(count);
+            offset += static_cast<uint64_t>(count);
+            m_size = std::max(m_size, offset);
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Cuts the file off, or extends it with zeros, to exactly size bytes.
+    /// </summary>
+    bool truncate(uint64_t size)
+    {
+#if defined(_WIN32)
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(size);
+        const bool resized = SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) && SetEndOfFile(m_file);
+#else
+        const bool resized = ::ftruncate(m_fd, static_cast<off_t>(size)) == 0;
+#endif
+        if (resized)
+        {
+            m_size = size;
+        }
+        return resized;
+    }
+
+    /// <summary>
+    /// Closes the file. Returns false if the close reported a failed write.
+    /// </summary>
+    bool close()
+    {
+        bool closed = true;
+#if defined(_WIN32)
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            closed = CloseHandle(m_file) != 0;
+            m_file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_fd >= 0)
+        {
+            closed = ::close(m_fd) == 0;
+            m_fd = -1;
+        }
+#endif
+        return closed;
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+#else
+    int m_fd = -1;
+#endif
+    uint64_t m_size = 0;
+};
+
+// Container layout (all integers little-endian):
+//   header  64 bytes   magic "CS405ENC", version, flags, cipher, chunk size, plaintext size,
+//                      chunk count, nonce, XXH64 of the preceding header bytes
+//   chunks             the stored bytes of every chunk, back to back; with the chunk-tags
+//                      header flag each chunk is followed by its 32-byte HMAC-SHA256 tag
+//   table   32 bytes   per chunk: file offset, plaintext offset, stored length,
+//                      plaintext length, chunk flags, reserved; a chunk with the compressed
+//                      flag stores an LZ4 block, encrypted, instead of the plaintext
+//   footer  32 bytes   table offset, chunk count, XXH64 of the table, magic "CS405IDX"
+// The footer sits at a fixed distance from the end of the file, so a reader finds the table
+// with two small reads and then seeks straight to any chunk. The chunk data comes before
+// the table, so the writer never has to go back: everything is known by the time the table
+// is written. The key is never stored, unlike the original text header.
+const unsigned char container_magic[8] = { 'C', 'S', '4', '0', '5', 'E', 'N', 'C' };
+const unsigned char container_footer_magic[8] = { 'C', 'S', '4', '0', '5', 'I', 'D', 'X' };
+const uint16_t container_version = 1;
+const size_t container_header_size = 64;
+const size_t container_entry_size = 32;
+const size_t container_footer_size = 32;
+// Header flag: every chunk is followed by an HMAC-SHA256 tag (see chunk_tag)
+const uint16_t container_flag_chunk_tags = 1;
+const size_t container_tag_size = 32;
+// Chunk flag: the stored bytes are the chunk's plaintext compressed as one LZ4 block. A chunk
+// is encrypted at its plaintext offset either way; stored bytes are never longer than the
+// plaintext, so chunks never share keystream.
+const uint32_t container_chunk_compressed = 1;
+const size_t default_container_chunk_size = 1 << 20;
+// Upper bound on container chunks, which the table stores as 32-bit lengths
+const uint64_t max_container_chunk_size = 1ull << 30;
+// Bytes read, transformed and written per gathered write; a container whose chunk data fits
+// in one batch is written with a single writev
+const size_t default_container_batch_size = 64u << 20;
+
+/// <summary>
+/// The container batch size. Under --max-mem a batch gets at most a quarter of the budget,
+/// since writing a compressed container or extracting one holds two batch-sized buffers.
+/// </summary>
+size_t container_batch_size()
+{
+    const uint64_t limit = MemoryBudget::instance().limit();
+    if (limit == 0)
+    {
+        return default_container_batch_size;
+    }
+    return static_cast<size_t>(std::clamp<uint64_t>(std::bit_floor(limit / 4), 64u << 10, default_container_batch_size));
+}
+
+/// <summary>
+/// The fixed header at the start of a container.
+/// </summary>
+struct ContainerHeader
+{
+    uint16_t version = container_version;
+    uint16_t flags = 0;
+    CipherKind cipher = CipherKind::xor_key;
+    ChaCha20Cipher::Nonce nonce = {};
+    uint32_t chunk_size = default_container_chunk_size; // plaintext bytes per chunk; the last may be shorter
+    uint64_t plaintext_size = 0;
+    uint64_t chunk_count = 0;
+};
+
+/// <summary>
+/// One entry of the container's chunk table.
+/// </summary>
+struct ContainerChunk
+{
+    uint64_t offset = 0;           // where the stored bytes start in the container file
+    uint64_t plaintext_offset = 0; // position in the plaintext, which is also the keystream offset
+    uint32_t stored_length = 0;
+    uint32_t plaintext_length = 0;
+    uint32_t flags = 0;
+};
+
+// Little-endian field access for the container's on-disk structures
+inline void store_le(unsigned char* bytes, uint64_t value, size_t width)
+{
+    for (size_t i = 0; i < width; ++i)
+    {
+        bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+inline uint64_t load_le(const unsigned char* bytes, size_t width)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < width; ++i)
+    {
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+void encode_container_header(const ContainerHeader& header, unsigned char bytes[container_header_size])
+{
+    std::memset(bytes, 0, container_header_size);
+    std::memcpy(bytes, container_magic, sizeof(container_magic));
+    store_le(bytes + 8, header.version, 2);
+    store_le(bytes + 10, header.flags, 2);
+    bytes[12] = static_cast<unsigned char>(header.cipher);
+    store_le(bytes + 16, header.chunk_size, 4);
+    store_le(bytes + 24, header.plaintext_size, 8);
+    store_le(bytes + 32, header.chunk_count, 8);
+    std::copy(header.nonce.begin(), header.nonce.end(), bytes + 40);
+    store_le(bytes + 56, Xxh64::hash(bytes, 56), 8);
+}
+
+/// <summary>
+/// Serializes the chunk table followed by the footer that points at it.
+/// </summary>
+/// <param name="table_offset">Where the table starts in the container file</param>
+std::vector<unsigned char> encode_container_index(const std::vector<ContainerChunk>& chunks, uint64_t table_offset)
+{
+    const size_t table_size = chunks.size() * container_entry_size;
+    std::vector<unsigned char> index(table_size + container_footer_size, 0);
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        unsigned char* entry = index.data() + i * container_entry_size;
+        store_le(entry, chunks[i].offset, 8);
+        store_le(entry + 8, chunks[i].plaintext_offset, 8);
+        store_le(entry + 16, chunks[i].stored_length, 4);
+        store_le(entry + 20, chunks[i].plaintext_length, 4);
+        store_le(entry + 24, chunks[i].flags, 4);
+    }
+
+    unsigned char* footer = index.data() + table_size;
+    store_le(footer, table_offset, 8);
+    store_le(footer + 8, chunks.size(), 8);
+    store_le(footer + 16, Xxh64::hash(index.data(), table_size), 8);
+    std::memcpy(footer + 24, container_footer_magic, sizeof(container_footer_magic));
+    return index;
+}
+
+/// <summary>
+/// Creates the HMAC that tags container chunks. Its key is SHA-256 of a label followed by
+/// the passphrase, so it is unrelated to the cipher key derived from the same passphrase.
+/// </summary>
+HmacSha256 make_chunk_authenticator(const std::string& passphrase)
+{
+    static const char label[] = "CS405 container chunk tag";
+    Sha256 state;
+    state.update(reinterpret_cast<const unsigned char*>(label), sizeof(label) - 1);
+    state.update(reinterpret_cast<const unsigned char*>(passphrase.data()), passphrase.length());
+    const Sha256::Digest key = state.finish();
+    return HmacSha256(key.data(), key.size());
+}
+
+/// <summary>
+/// Computes a chunk's tag over the encoded container header, the chunk's position, length
+/// and flags, and its stored (encrypted) bytes. Covering the header ties every chunk to the
+/// cipher, nonce and total size, so a container cannot be truncated or have chunks swapped
+/// in from another container; covering the position stops chunks from being reordered.
+/// </summary>
+Sha256::Digest chunk_tag(const HmacSha256& authenticator, const unsigned char header_bytes[container_header_size],
+                         const ContainerChunk& chunk, const unsigned char* stored)
+{
+    unsigned char position[16];
+    store_le(position, chunk.plaintext_offset, 8);
+    store_le(position + 8, chunk.plaintext_length, 4);
+    store_le(position + 12, chunk.flags, 4);
+
+    Sha256 message = authenticator.begin();
+    message.update(header_bytes, container_header_size);
+    message.update(position, sizeof(position));
+    message.update(stored, chunk.stored_length);
+    return authenticator.finish(message);
+}
+
+/// <summary>
+/// Encrypts a file into a container: header, then the chunks, then the chunk table and
+/// footer. The input is read container_batch_size() bytes at a time with positioned reads and
+/// each batch is encrypted in place by the engine, every chunk at its plaintext offset. The
+/// header (with the first batch), the chunk data and the index (with the last batch) go out
+/// as the buffers of one gathered write per batch, without being copied together first.
+/// With an authenticator every chunk is tagged on the thread that encrypted it, while the
+/// chunk is still in that core's cache, and the tag is written straight after the chunk.
+/// With compress, every chunk is first compressed in parallel; chunks that do not shrink
+/// by at least a sixteenth are stored as they are, so incompressible data costs nothing
+/// to decompress later.
+/// </summary>
+/// <param name="header">Cipher, nonce and chunk size; the sizes and counts are filled in here</param>
+/// <param name="authenticator">Tags every chunk when not null</param>
+/// <param name="compress">Compress each chunk before it is encrypted, where that saves space</param>
+/// <param name="bytes_processed">Receives the number of plaintext bytes encrypted</param>
+/// <returns>True if the container was written</returns>
+template <typename Engine>
+bool write_container(const std::string& input_filename, const std::string& output_filename, Engine& engine,
+                     ContainerHeader header, const HmacSha256* authenticator, bool compress, uint64_t& bytes_processed)
+{
+    assert(header.chunk_size > 0);
+    bytes_processed = 0;
+
+    StageTimer open_timer("open");
+    RandomAccessFile input;
+    if (!input.open_read(input_filename))
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+    RandomAccessFile output;
+    if (!output.create(output_filename))
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    header.plaintext_size = input.size();
+    header.chunk_count = (header.plaintext_size + header.chunk_size - 1) / header.chunk_size;
+    header.flags = authenticator != nullptr ? container_flag_chunk_tags : 0;
+    const size_t tag_size = authenticator != nullptr ? container_tag_size : 0;
+    unsigned char header_bytes[container_header_size];
+    encode_container_header(header, header_bytes);
+
+    const size_t batch_chunks = std::max<size_t>(1, container_batch_size() / header.chunk_size);
+    const auto batch_capacity = static_cast<size_t>(
+        std::min<uint64_t>(header.plaintext_size, static_cast<uint64_t>(batch_chunks) * header.chunk_size));
+    const BufferArena::Buffer batch = BufferArena::local().acquire(batch_capacity);
+    std::vector<ContainerChunk> chunks;
+    chunks.reserve(static_cast<size_t>(header.chunk_count));
+    const BufferArena::Buffer packed = compress ? BufferArena::local().acquire(batch_capacity) : BufferArena::Buffer();
+    std::vector<unsigned char*> stored(batch_chunks);
+    std::vector<Sha256::Digest> tags(authenticator != nullptr ? batch_chunks : 0);
+    std::vector<unsigned char> index;
+
+    uint64_t offset = 0;
+    uint64_t data_end = container_header_size;
+    do
+    {
+        const auto length = static_cast<size_t>(std::min<uint64_t>(batch_capacity, header.plaintext_size - offset));
+        StageTimer read_timer("read");
+        if (!input.read_at(batch.get(), length, offset))
+        {
+            std::cerr << "Error reading file: " << input_filename << std::endl;
+            return false;
+        }
+        read_timer.finish(length);
+
+        const size_t first_chunk = chunks.size();
+        for (size_t begin = 0; begin < length; begin += header.chunk_size)
+        {
+            ContainerChunk chunk;
+            chunk.plaintext_offset = offset + begin;
+            chunk.plaintext_length = static_cast<uint32_t>(std::min<size_t>(header.chunk_size, length - begin));
+            chunk.stored_length = chunk.plaintext_length;
+            stored[chunks.size() - first_chunk] = batch.get() + begin;
+            chunks.push_back(chunk);
+        }
+        const size_t batch_count = chunks.size() - first_chunk;
+
+        if (compress)
+        {
+            StageTimer compress_timer("compress");
+            engine.parallel_for(batch_count, [&](size_t i) {
+                ContainerChunk& chunk = chunks[first_chunk + i];
+                unsigned char* target = packed.get() + (chunk.plaintext_offset - offset);
+                const size_t packed_length = lz4_compress(stored[i], chunk.plaintext_length, target,
+                                                          chunk.plaintext_length - chunk.plaintext_length / 16);
+                if (packed_length > 0)
+                {
+                    chunk.stored_length = static_cast<uint32_t>(packed_length);
+                    chunk.flags |= container_chunk_compressed;
+                    stored[i] = target;
+                }
+            });
+            compress_timer.finish(length);
+        }
+
+        // With fewer chunks than threads, split each chunk's transform across the threads instead
+        StageTimer transform_timer("transform");
+        const bool split = batch_count < engine.thread_count();
+        for (size_t i = 0; split && i < batch_count; ++i)
+        {
+            const ContainerChunk& chunk = chunks[first_chunk + i];
+            engine.transform(stored[i], stored[i], chunk.stored_length, chunk.plaintext_offset);
+        }
+        engine.parallel_for(batch_count, [&](size_t i) {
+            const ContainerChunk& chunk = chunks[first_chunk + i];
+            if (!split)
+            {
+                engine.cipher().apply(stored[i], stored[i], chunk.stored_length, chunk.plaintext_offset);
+            }
+            if (authenticator != nullptr)
+            {
+                tags[i] = chunk_tag(*authenticator, header_bytes, chunk, stored[i]);
+            }
+        });
+        transform_timer.finish(length);
+
+        std::vector<ConstBuffer> buffers;
+        if (output.size() == 0)
+        {
+            buffers.push_back(ConstBuffer{ header_bytes, sizeof(header_bytes) });
+        }
+        for (size_t i = 0; i < batch_count; ++i)
+        {
+            ContainerChunk& chunk = chunks[first_chunk + i];
+            chunk.offset = data_end;
+            data_end += chunk.stored_length + tag_size;
+            buffers.push_back(ConstBuffer{ stored[i], chunk.stored_length });
+            if (authenticator != nullptr)
+            {
+                buffers.push_back(ConstBuffer{ tags[i].data(), tags[i].size() });
+            }
+        }
+        offset += length;
+        if (offset == header.plaintext_size)
+        {
+            index = encode_container_index(chunks, data_end);
+            buffers.push_back(ConstBuffer{ index.data(), index.size() });
+        }
+
+        StageTimer write_timer("write");
+        if (!output.write_gathered(buffers))
+        {
+            std::cerr << "Error writing to file: " << output_filename << std::endl;
+            return false;
+        }
+        write_timer.finish(length);
+    } while (offset < header.plaintext_size);
+
+    StageTimer close_timer("write");
+    if (!output.close())
+    {
+        std::cerr << "Error writing to file: " << output_filename << std::endl;
+        return false;
+    }
+    bytes_processed = header.plaintext_size;
+    return true;
+}
+
+/// <summary>
+/// An open container: the validated header and chunk table, and the file for reading chunks.
+/// </summary>
+class ContainerReader
+{
+public:
+    /// <summary>
+    /// Opens a container and reads its header, footer and chunk table, rejecting anything
+    /// inconsistent (bad magic or checksums, chunks outside the data area or out of order).
+    /// </summary>
+    /// <returns>True if the file is a valid container</returns>
+    bool open(const std::string& filename)
+    {
+        m_filename = filename;
+        m_chunks.clear();
+        if (!m_file.open_read(filename))
+        {
+            std::cerr << "Unable to open file: " << filename << std::endl;
+            return false;
+        }
+
+        const uint64_t file_size = m_file.size();
+        unsigned char* const header = m_header_bytes;
+        unsigned char footer[container_footer_size];
+        if (file_size < container_header_size + container_footer_size ||
+            !m_file.read_at(header, container_header_size, 0) ||
+            !m_file.read_at(footer, sizeof(footer), file_size - sizeof(footer)))
+        {
+            return invalid("too short");
+        }
+        if (std::memcmp(header, container_magic, sizeof(container_magic)) != 0 ||
+            std::memcmp(footer + 24, container_footer_magic, sizeof(container_footer_magic)) != 0)
+        {
+            return invalid("bad magic number");
+        }
+        if (load_le(header + 56, 8) != Xxh64::hash(header, 56))
+        {
+            return invalid("header checksum mismatch");
+        }
+
+        m_header.version = static_cast<uint16_t>(load_le(header + 8, 2));
+        m_header.flags = static_cast<uint16_t>(load_le(header + 10, 2));
+        m_header.chunk_size = static_cast<uint32_t>(load_le(header + 16, 4));
+        m_header.plaintext_size = load_le(header + 24, 8);
+        m_header.chunk_count = load_le(header + 32, 8);
+        std::copy(header + 40, header + 52, m_header.nonce.begin());
+        if (m_header.version != container_version || (m_header.flags & ~container_flag_chunk_tags) != 0)
+        {
+            return invalid("unsupported version or flags");
+        }
+        if (header[12] > static_cast<unsigned char>(CipherKind::aes256_ctr))
+        {
+            return invalid("unknown cipher");
+        }
+        m_header.cipher = static_cast<CipherKind>(header[12]);
+
+        const uint64_t table_offset = load_le(footer, 8);
+        const uint64_t table_limit = file_size - container_footer_size;
+        if (m_header.chunk_size == 0 || m_header.chunk_size > max_container_chunk_size ||
+            load_le(footer + 8, 8) != m_header.chunk_count ||
+            table_offset < container_header_size || table_offset > table_limit ||
+            (table_limit - table_offset) / container_entry_size != m_header.chunk_count ||
+            (table_limit - table_offset) % container_entry_size != 0)
+        {
+            return invalid("chunk table does not match the header");
+        }
+
+        StageTimer read_timer("read");
+        const auto table_size = static_cast<size_t>(table_limit - table_offset);
+        std::vector<unsigned char> table(table_size);
+        if (!m_file.read_at(table.data(), table_size, table_offset))
+        {
+            return invalid("unable to read the chunk table");
+        }
+        read_timer.finish(table_size);
+        if (load_le(footer + 16, 8) != Xxh64::hash(table.data(), table_size))
+        {
+            return invalid("chunk table checksum mismatch");
+        }
+
+        m_chunks.resize(static_cast<size_t>(m_header.chunk_count));
+        uint64_t plaintext_end = 0;
+        uint64_t data_end = container_header_size;
+        const size_t tag_size = tagged() ? container_tag_size : 0;
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            const unsigned char* entry = table.data() + i * container_entry_size;
+            ContainerChunk& chunk = m_chunks[i];
+            chunk.offset = load_le(entry, 8);
+            chunk.plaintext_offset = load_le(entry + 8, 8);
+            chunk.stored_length = static_cast<uint32_t>(load_le(entry + 16, 4));
+            chunk.plaintext_length = static_cast<uint32_t>(load_le(entry + 20, 4));
+            chunk.flags = static_cast<uint32_t>(load_le(entry + 24, 4));
+            const bool compressed = (chunk.flags & container_chunk_compressed) != 0;
+            if ((chunk.flags & ~container_chunk_compressed) != 0 || chunk.plaintext_offset != plaintext_end ||
+                chunk.offset < data_end || chunk.plaintext_length == 0 || chunk.plaintext_length > m_header.chunk_size ||
+                (compressed ? chunk.stored_length == 0 || chunk.stored_length >= chunk.plaintext_length
+                            : chunk.stored_length != chunk.plaintext_length) ||
+                chunk.offset > table_offset || chunk.stored_length + tag_size > table_offset - chunk.offset)
+            {
+                return invalid("corrupt chunk table entry");
+            }
+            plaintext_end += chunk.plaintext_length;
+            data_end = chunk.offset + chunk.stored_length + tag_size;
+        }
+        if (plaintext_end != m_header.plaintext_size)
+        {
+            return invalid("chunk table does not cover the plaintext");
+        }
+        return true;
+    }
+
+    const std::string& filename() const { return m_filename; }
+    const ContainerHeader& header() const { return m_header; }
+    const unsigned char* header_bytes() const { return m_header_bytes; }
+    bool tagged() const { return (m_header.flags & container_flag_chunk_tags) != 0; }
+    // Bytes a chunk occupies in the file: its stored bytes and its tag, if any
+    uint64_t footprint(const ContainerChunk& chunk) const
+    {
+        return chunk.stored_length + (tagged() ? container_tag_size : 0);
+    }
+    const std::vector<ContainerChunk>& chunks() const { return m_chunks; }
+    const RandomAccessFile& file() const { return m_file; }
+
+private:
+    bool invalid(const char* reason)
+    {
+        std::cerr << "Not a valid container: " << m_filename << " (" << reason << ")" << std::endl;
+        return false;
+    }
+
+    std::string m_filename;
+    RandomAccessFile m_file;
+    ContainerHeader m_header;
+    unsigned char m_header_bytes[container_header_size] = {};
+    std::vector<ContainerChunk> m_chunks;
+};
+
+/// <summary>
+/// Reads a container's chunks in batches: chunks that sit next to each other in the file
+/// are fetched together, up to container_batch_size() bytes per positioned read and (so
+/// compressed chunks can be expanded next to them) of plaintext. Calls
+/// process(first, last, data) for every batch, where data holds chunks [first, last)
+/// exactly as stored, tags included.
+/// </summary>
+/// <returns>False if a read failed or process returned false</returns>
+template <typename Process>
+bool read_container_batches(const ContainerReader& container, Process&& process)
+{
+    const std::vector<ContainerChunk>& chunks = container.chunks();
+    const uint64_t data_size = chunks.empty() ? 0 : chunks.back().offset + container.footprint(chunks.back()) - chunks.front().offset;
+    const size_t batch_size = container_batch_size();
+    const BufferArena::Buffer batch = BufferArena::local().acquire(static_cast<size_t>(std::max<uint64_t>(
+        std::min<uint64_t>(data_size, batch_size), container.header().chunk_size + container_tag_size)));
+
+    for (size_t first = 0; first < chunks.size();)
+    {
+        // Extend the batch while the next chunk follows on directly and still fits
+        size_t last = first + 1;
+        auto length = static_cast<size_t>(container.footprint(chunks[first]));
+        while (last < chunks.size() && chunks[last].offset == chunks[first].offset + length &&
+               length + container.footprint(chunks[last]) <= batch_size &&
+               chunks[last].plaintext_offset + chunks[last].plaintext_length - chunks[first].plaintext_offset <= batch_size)
+        {
+            length += static_cast<size_t>(container.footprint(chunks[last]));
+            ++last;
+        }
+
+        StageTimer read_timer("read");
+        if (!container.file().read_at(batch.get(), length, chunks[first].offset))
+        {
+            std::cerr << "Error reading file: " << container.filename() << std::endl;
+            return false;
+        }
+        read_timer.finish(length);
+
+        if (!process(first, last, batch.get()))
+        {
+            return false;
+        }
+        first = last;
+    }
+    return true;
+}
+
+/// <summary>
+/// Checks the tags of chunks [first, last), whose stored bytes and tags are in data as read
+/// by read_container_batches, in parallel on the engine's threads. Every chunk is judged on
+/// its own: a failed chunk is reported with its plaintext range and marked in rejected,
+/// and the chunks around it are unaffected.
+/// </summary>
+/// <param name="rejected">Receives one entry per chunk, non-zero where the tag did not match</param>
+/// <returns>The number of chunks that failed</returns>
+template <typename Engine>
+size_t verify_chunk_tags(const ContainerReader& container, Engine& engine, const HmacSha256& authenticator,
+                         size_t first, size_t last, const unsigned char* data, std::vector<unsigned char>& rejected)
+{
+    const std::vector<ContainerChunk>& chunks = container.chunks();
+    rejected.assign(last - first, 0);
+    if (!container.tagged())
+    {
+        return 0;
+    }
+
+    StageTimer verify_timer("verify");
+    engine.parallel_for(last - first, [&](size_t i) {
+        const ContainerChunk& chunk = chunks[first + i];
+        const unsigned char* stored = data + (chunk.offset - chunks[first].offset);
+        Sha256::Digest expected;
+        std::copy(stored + chunk.stored_length, stored + chunk.stored_length + container_tag_size, expected.begin());
+        rejected[i] = HmacSha256::equal(chunk_tag(authenticator, container.header_bytes(), chunk, stored), expected) ? 0 : 1;
+    });
+    verify_timer.finish(chunks[last - 1].offset + chunks[last - 1].stored_length - chunks[first].offset);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < rejected.size(); ++i)
+    {
+        if (rejected[i] != 0)
+        {
+            const ContainerChunk& chunk = chunks[first + i];
+            std::cerr << "Chunk " << first + i << " (bytes " << chunk.plaintext_offset << " to "
+                      << chunk.plaintext_offset + chunk.plaintext_length << ") failed authentication" << std::endl;
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+/// <summary>
+/// Decrypts a whole container into a plain file, each chunk at its own plaintext offset,
+/// spread across the engine's threads. In a tagged container every chunk's tag is checked
+/// before it is decrypted, and compressed chunks are expanded in parallel after it. A chunk
+/// that fails either step is written as zeros, so the chunks around it still land at their
+/// offsets and can be recovered, and the call returns false.
+/// </summary>
+/// <param name="engine">Engine over the cipher named in the container's header</param>
+/// <param name="authenticator">Checks the chunk tags of a tagged container</param>
+/// <param name="bytes_processed">Receives the number of plaintext bytes written</param>
+/// <returns>True if the plain file was written and every chunk was authentic</returns>
+template <typename Engine>
+bool extract_container(const ContainerReader& container, const std::string& output_filename, Engine& engine,
+                       const HmacSha256& authenticator, uint64_t& bytes_processed)
+{
+    bytes_processed = 0;
+    StageTimer open_timer("open");
+    RandomAccessFile output;
+    if (!output.create(output_filename))
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+    open_timer.finish();
+
+    const std::vector<ContainerChunk>& chunks = container.chunks();
+    const bool any_compressed = std::any_of(chunks.begin(), chunks.end(), [](const ContainerChunk& chunk) {
+        return (chunk.flags & container_chunk_compressed) != 0;
+    });
+    const BufferArena::Buffer unpacked = any_compressed
+        ? BufferArena::local().acquire(static_cast<size_t>(std::max<uint64_t>(
+              std::min<uint64_t>(container.header().plaintext_size, container_batch_size()), container.header().chunk_size)))
+        : BufferArena::Buffer();
+    std::vector<unsigned char> rejected;
+    size_t failures = 0;
+    const bool extracted = read_container_batches(container, [&](size_t first, size_t last, unsigned char* data) {
+        failures += verify_chunk_tags(container, engine, authenticator, first, last, data, rejected);
+
+        // Chunks go to the threads one each, unless there are fewer chunks than threads; then
+        // each chunk's transform is split across the threads instead
+        StageTimer transform_timer("transform");
+        const bool split = last - first < engine.thread_count();
+        const auto decrypt = [&](size_t i) {
+            const ContainerChunk& chunk = chunks[first + i];
+            unsigned char* stored = data + (chunk.offset - chunks[first].offset);
+            if (rejected[i] != 0)
+            {
+                std::memset(stored, 0, chunk.stored_length);
+            }
+            else if (split)
+            {
+                engine.transform(stored, stored, chunk.stored_length, chunk.plaintext_offset);
+            }
+            else
+            {
+                engine.cipher().apply(stored, stored, chunk.stored_length, chunk.plaintext_offset);
+            }
+        };
+        if (split)
+        {
+            for (size_t i = 0; i < last - first; ++i)
+            {
+                decrypt(i);
+            }
+        }
+        else
+        {
+            engine.parallel_for(last - first, decrypt);
+        }
+
+        transform_timer.finish(chunks[last - 1].offset + chunks[last - 1].stored_length - chunks[first].offset);
+
+        std::vector<ConstBuffer> buffers;
+        uint64_t length = 0;
+        for (size_t i = first; i < last; ++i)
+        {
+            const ContainerChunk& chunk = chunks[i];
+            const unsigned char* plaintext = data + (chunk.offset - chunks[first].offset);
+            if ((chunk.flags & container_chunk_compressed) != 0)
+            {
+                plaintext = unpacked.get() + (chunk.plaintext_offset - chunks[first].plaintext_offset);
+            }
+            buffers.push_back(ConstBuffer{ plaintext, chunk.plaintext_length });
+            length += chunk.plaintext_length;
+        }
+
+        if (any_compressed)
+        {
+            StageTimer decompress_timer("decompress");
+            std::vector<unsigned char> corrupt(last - first, 0);
+            engine.parallel_for(last - first, [&](size_t i) {
+                const ContainerChunk& chunk = chunks[first + i];
+                if ((chunk.flags & container_chunk_compressed) == 0)
+                {
+                    return;
+                }
+                auto* target = const_cast<unsigned char*>(static_cast<const unsigned char*>(buffers[i].data));
+                if (rejected[i] != 0 ||
+                    !lz4_decompress(data + (chunk.offset - chunks[first].offset), chunk.stored_length, target,
+                                    chunk.plaintext_length))
+                {
+                    corrupt[i] = rejected[i] == 0;
+                    std::memset(target, 0, chunk.plaintext_length);
+                }
+            });
+            decompress_timer.finish(length);
+
+            for (size_t i = 0; i < corrupt.size(); ++i)
+            {
+                if (corrupt[i] != 0)
+                {
+                    const ContainerChunk& chunk = chunks[first + i];
+                    std::cerr << "Chunk " << first + i << " (bytes " << chunk.plaintext_offset << " to "
+                              << chunk.plaintext_offset + chunk.plaintext_length << ") could not be decompressed" << std::endl;
+                    ++failures;
+                }
+            }
+        }
+
+        // The tags between the chunks are skipped by the gathered write
+        StageTimer write_timer("write");
+        if (!output.write_gathered(buffers))
+        {
+            std::cerr << "Error writing to file: " << output_filename << std::endl;
+            return false;
+        }
+        write_timer.finish(length);
+        bytes_processed += length;
+        return true;
+    });
+
+    StageTimer close_timer("write");
+    if (!output.close() && extracted)
+    {
+        std::cerr << "Error writing to file: " << output_filename << std::endl;
+        return false;
+    }
+    if (failures > 0)
+    {
+        std::cerr << failures << " of " << chunks.size() << " chunks were corrupt and were written as zeros" << std::endl;
+    }
+    return extracted && failures == 0;
+}
+
+// Manifest of an incrementally encrypted file: "CS405MAN", version, chunk size, plaintext
+// size, chunk count, one XXH64 per chunk of ciphertext and an XXH64 of everything before it
+const unsigned char manifest_magic[8] = { 'C', 'S', '4', '0', '5', 'M', 'A', 'N' };
+const uint16_t manifest_version = 1;
+const size_t manifest_header_size = 40;
+
+/// <summary>
+/// Per-chunk hashes of the ciphertext as it was last written by --incremental.
+/// </summary>
+struct ChunkManifest
+{
+    uint64_t chunk_size = 0;
+    uint64_t plaintext_size = 0;
+    std::vector<uint64_t> hashes;
+};
+
+/// <summary>
+/// Reads a manifest written by save_chunk_manifest.
+/// </summary>
+/// <returns>False if the file is missing, truncated or fails its checksum</returns>
+bool load_chunk_manifest(const std::string& filename, ChunkManifest& manifest)
+{
+    RandomAccessFile file;
+    if (!file.open_read(filename) || file.size() < manifest_header_size + 8)
+    {
+        return false;
+    }
+    std::vector<unsigned char> bytes(static_cast<size_t>(file.size()));
+    if (!file.read_at(bytes.data(), bytes.size(), 0))
+    {
+        return false;
+    }
+
+    const size_t body_size = bytes.size() - 8;
+    const uint64_t chunk_count = load_le(bytes.data() + 32, 8);
+    if (std::memcmp(bytes.data(), manifest_magic, sizeof(manifest_magic)) != 0 ||
+        load_le(bytes.data() + 8, 2) != manifest_version ||
+        chunk_count != (body_size - manifest_header_size) / 8 || (body_size - manifest_header_size) % 8 != 0 ||
+        load_le(bytes.data() + body_size, 8) != Xxh64::hash(bytes.data(), body_size))
+    {
+        return false;
+    }
+
+    manifest.chunk_size = load_le(bytes.data() + 16, 8);
+    manifest.plaintext_size = load_le(bytes.data() + 24, 8);
+    manifest.hashes.resize(static_cast<size_t>(chunk_count));
+    for (size_t i = 0; i < manifest.hashes.size(); ++i)
+    {
+        manifest.hashes[i] = load_le(bytes.data() + manifest_header_size + i * 8, 8);
+    }
+    return true;
+}
+
+/// <summary>
+/// Writes a manifest next to its final name and renames it into place, so a crash leaves
+/// either the old manifest or the new one, never half of one.
+/// </summary>
+/// <returns>True if the manifest was saved</returns>
+bool save_chunk_manifest(const std::string& filename, const ChunkManifest& manifest)
+{
+    std::vector<unsigned char> bytes(manifest_header_size + manifest.hashes.size() * 8 + 8, 0);
+    std::memcpy(bytes.data(), manifest_magic, sizeof(manifest_magic));
+    store_le(bytes.data() + 8, manifest_version, 2);
+    store_le(bytes.data() + 16, manifest.chunk_size, 8);
+    store_le(bytes.data() + 24, manifest.plaintext_size, 8);
+    store_le(bytes.data() + 32, manifest.hashes.size(), 8);
+    for (size_t i = 0; i < manifest.hashes.size(); ++i)
+    {
+        store_le(bytes.data() + manifest_header_size + i * 8, manifest.hashes[i], 8);
+    }
+    const size_t body_size = bytes.size() - 8;
+    store_le(bytes.data() + body_size, Xxh64::hash(bytes.data(), body_size), 8);
+
+    const std::string temporary_filename = filename + ".tmp";
+    RandomAccessFile file;
+    const ConstBuffer buffer{ bytes.data(), bytes.size() };
+    const bool written = file.create(temporary_filename) &&
+                         file.write_gathered(std::span<const ConstBuffer>(&buffer, 1)) && file.close();
+    std::error_code error;
+    if (!written || (std::filesystem::rename(temporary_filename, filename, error), error))
+    {
+        std::cerr << "Unable to save manifest: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Outcome of one incremental run.
+/// </summary>
+struct IncrementalResult
+{
+    uint64_t chunk_count = 0;
+    uint64_t chunks_rewritten = 0;
+    uint64_t bytes_written = 0;
+};
+
+/// <summary>
+/// Brings a raw ciphertext file up to date with a changed plaintext by rewriting only the
+/// chunks that changed. Every chunk is still read and encrypted, which is cheap next to
+/// the write, and the manifest holds an XXH64 of each chunk's ciphertext from the previous
+/// run: a chunk whose new ciphertext hashes the same is left untouched on disk, and the
+/// rest are written in place at their offsets. Hashing the ciphertext rather than the
+/// plaintext means the manifest reveals nothing the ciphertext does not, and a new key,
+/// cipher or nonce changes every hash, so it rewrites everything without any special case.
+/// Chunks sit at fixed offsets, so an insertion rewrites every chunk after it. A rewritten
+/// chunk is encrypted with the same keystream as the version it replaces, as with
+/// --in-place: someone holding both ciphertexts learns the XOR of the two plaintexts.
+/// The old manifest is deleted before the first write and the new one saved after the
+/// last, so an interrupted run falls back to a full rewrite instead of trusting stale hashes.
+/// </summary>
+/// <param name="engine">Applies the key, on one or more threads</param>
+/// <param name="chunk_size">Plaintext bytes per chunk; a manifest with another size is not used</param>
+/// <param name="sync_output">Flush the ciphertext to disk before saving the manifest</param>
+/// <returns>True if the ciphertext and the manifest were brought up to date</returns>
+template <typename Engine>
+bool incremental_transform_file(const std::string& input_filename, const std::string& output_filename,
+                                const std::string& manifest_filename, Engine& engine, size_t chunk_size,
+                                bool sync_output, IncrementalResult& result)
+{
+    assert(chunk_size > 0);
+    result = IncrementalResult();
+
+    StageTimer open_timer("open");
+    RandomAccessFile input;
+    if (!input.open_read(input_filename))
+    {
+        std::cerr << "Unable to open file: " << input_filename << std::endl;
+        return false;
+    }
+    RandomAccessFile output;
+    if (!output.open_update(output_filename))
+    {
+        std::cerr << "Unable to open file for writing: " << output_filename << std::endl;
+        return false;
+    }
+
+    ChunkManifest previous;
+    bool manifest_current = true;
+    if (!load_chunk_manifest(manifest_filename, previous))
+    {
+        std::cerr << "No usable manifest at " << manifest_filename << "; encrypting every chunk" << std::endl;
+        previous = ChunkManifest();
+        manifest_current = false;
+    }
+    else if (previous.chunk_size != chunk_size || previous.plaintext_size != output.size())
+    {
+        // The ciphertext is not the one the manifest describes, or is chunked differently
+        std::cerr << "Manifest does not match " << output_filename << "; encrypting every chunk" << std::endl;
+        previous = ChunkManifest();
+        std::error_code error;
+        std::filesystem::remove(manifest_filename, error);
+        manifest_current = false;
+    }
+    open_timer.finish();
+
+    const uint64_t plaintext_size = input.size();
+    ChunkManifest current;
+    current.chunk_size = chunk_size;
+    current.plaintext_size = plaintext_size;
+    current.hashes.resize(static_cast<size_t>((plaintext_size + chunk_size - 1) / chunk_size));
+    result.chunk_count = current.hashes.size();
+
+    // The old hashes stop describing the file as soon as it is modified
+    const auto begin_update = [&] {
+        if (manifest_current)
+        {
+            std::error_code error;
+            std::filesystem::remove(manifest_filename, error);
+            manifest_current = false;
+        }
+    };
+
+    const size_t batch_chunks = std::max<size_t>(1, container_batch_size() / chunk_size);
+    const BufferArena::Buffer batch = BufferArena::local().acquire(static_cast<size_t>(
+        std::min<uint64_t>(plaintext_size, static_cast<uint64_t>(batch_chunks) * chunk_size)));
+    std::vector<unsigned char> changed;
+
+    for (size_t first = 0; first < current.hashes.size(); first += batch_chunks)
+    {
+        const size_t last = std::min(current.hashes.size(), first + batch_chunks);
+        const uint64_t offset = static_cast<uint64_t>(first) * chunk_size;
+        const auto length = static_cast<size_t>(std::min<uint64_t>(plaintext_size, static_cast<uint64_t>(last) * chunk_size) - offset);
+
+        StageTimer read_timer("read");
+        if (!input.read_at(batch.get(), length, offset))
+        {
+            std::cerr << "Error reading file: " << input_filename << std::endl;
+            return false;
+        }
+        read_timer.finish(length);
+
+        StageTimer transform_timer("transform");
+        engine.transform(batch.get(), batch.get(), length, offset);
+        changed.assign(last - first, 0);
+        engine.parallel_for(last - first, [&](size_t i) {
+            const size_t chunk = first + i;
+            const size_t chunk_length = std::min<size_t>(chunk_size, length - i * chunk_size);
+            current.hashes[chunk] = Xxh64::hash(batch.get() + i * chunk_size, chunk_length);
+            changed[i] = chunk >= previous.hashes.size() || previous.hashes[chunk] != current.hashes[chunk] ? 1 : 0;
+        });
+        transform_timer.finish(length);
+
+        // Runs of neighbouring changed chunks go out as one write
+        for (size_t i = 0; i < changed.size();)
+        {
+            if (changed[i] == 0)
+            {
+                ++i;
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < changed.size() && changed[end] != 0)
+            {
+                ++end;
+            }
+            const size_t run_length = std::min<size_t>(end * chunk_size, length) - i * chunk_size;
+
+            begin_update();
+            StageTimer write_timer("write");
+            if (!output.write_at(batch.get() + i * chunk_size, run_length, offset + i * chunk_size))
+            {
+                std::cerr << "Error writing to file: " << output_filename << std::endl;
+                return false;
+            }
+            write_timer.finish(run_length);
+            result.chunks_rewritten += end - i;
+            result.bytes_written += run_length;
+            i = end;
+        }
+    }
+
+    StageTimer close_timer("write");
+    if (output.size() != plaintext_size)
+    {
+        begin_update();
+    }
+    if ((output.size() != plaintext_size && !output.truncate(plaintext_size)) || !output.close())
+    {
+        std::cerr << "Error writing to file: " << output_filename << std::endl;
+        return false;
+    }
+    close_timer.finish();
+
+    if (sync_output && !sync_file(output_filename))
+    {
+        return false;
+    }
+    // An unchanged file keeps its manifest as it is
+    return manifest_current || save_chunk_manifest(manifest_filename, current);
+}
+
+/// <summary>
+/// How the file-to-file transform moves data between disk and memory.
+/// </summary>
+enum class IoMode
+{
+    whole_file, // read_file -> encrypt_decrypt -> write_file
+    stream,     // fixed-size buffer, chunk by chunk
+    mmap,       // memory-mapped input and output, no read()/write() copies
+    uring,      // io_uring with several buffers in flight (Linux; falls back to stream)
+    pipeline,   // reader thread -> transform workers -> writer thread
+    direct      // O_DIRECT reads and writes that bypass the page cache
+};
+
+/// <summary>
+/// Settings for one run of the program, filled in from the command line.
+/// The defaults reproduce the original hardcoded behavior.
+/// </summary>
+struct ProgramOptions
+{
+    std::string input_filename = "inputdatafile.txt";
+    std::string encrypted_filename = "encrypted_output.txt";
+    std::string decrypted_filename = "decrypted_output.txt";
+    std::string key = "password";
+    CipherKind cipher = CipherKind::xor_key;
+    ChaCha20Cipher::Nonce nonce = {};
+    IoMode io_mode = IoMode::whole_file;
+    size_t buffer_size = default_stream_buffer_size;
+    bool buffer_size_given = false;
+    unsigned thread_count = default_thread_count();
+    unsigned queue_depth = default_queue_depth;
+    bool in_place = false;
+    bool fused = false;
+    bool paranoid = false;
+    bool pipe = false;
+    bool container = false;
+    bool chunk_tags = false;
+    bool compress = false;
+    std::string verify_filename;
+    std::string incremental_manifest;
+    bool range_given = false;
+    uint64_t range_offset = 0;
+    uint64_t range_length = 0;
+    size_t container_chunk_size = default_container_chunk_size;
+    bool sync_output = false;
+    uint64_t max_memory = 0;
+    std::string profile_filename;
+    std::string trace_filename;
+    std::string batch_source;
+    std::string batch_destination;
+    std::string batch_summary;
+    std::string compare_first;
+    std::string compare_second;
+    bool self_test = false;
+    bool benchmark = false;
+    uint64_t benchmark_max_size = default_benchmark_max_size;
+    std::string benchmark_output;
+    bool show_help = false;
+};
+
+/// <summary>
+/// Parses a byte count such as "4096", "64K", "16M" or "2G" (binary multiples).
+/// </summary>
+/// <param name="text">The text to parse</param>
+/// <param name="value">Receives the parsed value</param>
+/// <returns>True if the text was a valid, non-zero size</returns>
+bool parse_size(const std::string& text, uint64_t& value)
+{
+    if (text.empty() || text[0] < '0' || text[0] > '9')
+    {
+        return false;
+    }
+
+    size_t consumed = 0;
+    unsigned long long number = 0;
+    try
+    {
+        number = std::stoull(text, &consumed);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    int shift = 0;
+    if (consumed < text.length())
+    {
+        switch (text[consumed])
+        {
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        default: return false;
+        }
+        ++consumed;
+    }
+
+    if (consumed != text.length() || number == 0 || number > (~0ull >> shift))
+    {
+        return false;
+    }
+
+    value = static_cast<uint64_t>(number) << shift;
+    return true;
+}
+
+/// <summary>
+/// Parses exactly value.size() bytes written as hexadecimal digits.
+/// </summary>
+/// <returns>True if the text had the right length and only hex digits</returns>
+template <size_t N>
+bool parse_hex(const std::string& text, std::array<unsigned char, N>& value)
+{
+    if (text.length() != 2 * N)
+    {
+        return false;
+    }
+
+    const auto digit = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < N; ++i)
+    {
+        const int high = digit(text[2 * i]);
+        const int low = digit(text[2 * i + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        value[i] = static_cast<unsigned char>(high * 16 + low);
+    }
+    return true;
+}
+
+void print_usage(const char* program_name)
+{
+    std::cout << "Usage: " << program_name << " [options]\n"
+              << "  --input <file>        File to encrypt (default: inputdatafile.txt)\n"
+              << "  --encrypted <file>    Where to write the ciphertext (default: encrypted_output.txt)\n"
+              << "  --decrypted <file>    Where to write the decrypted copy (default: decrypted_output.txt)\n"
+              << "  --key <key>           Encryption key (default: password)\n"
+              << "  --cipher <name>       xor: repeating-key XOR (default)\n"
+              << "                        chacha20: ChaCha20 keyed with SHA-256 of --key\n"
+              << "                        aes256-ctr: AES-256 in counter mode keyed with SHA-256 of --key\n"
+              << "  --nonce <hex>         24 hex digits; ChaCha20 nonce, or the first 12 bytes of the AES counter block.\n"
+              << "                        Never reuse a nonce with the same key (default: zeros)\n"
+              << "  --mode <mode>         whole: load whole files (default)\n"
+              << "                        stream: process through one fixed-size buffer\n"
+              << "                        mmap: memory-map the input and output files\n"
+              << "                        uring: asynchronous io_uring reads and writes (Linux)\n"
+              << "                        pipeline: overlapped reader, transform and writer threads\n"
+              << "                        direct: bypass the page cache (O_DIRECT), leaving other programs' cache alone;\n"
+              << "                        also applies to --batch\n"
+              << "  --buffer-size <size>  Stream buffer size, e.g. 64K or 4M (default: 1M)\n"
+              << "  --queue-depth <count> Buffers kept in flight by --mode uring and direct (default: 8)\n"
+              << "  --threads <count>     Worker threads for the transform (default: one per hardware thread)\n"
+              << "  --fused               Encrypt and verify the round trip in one streaming pass\n"
+              << "  --paranoid            With --fused, also decrypt the written file and compare it to the input\n"
+              << "  --container           Write the ciphertext as a chunked binary container and decrypt it from there\n"
+              << "  --compress            With --container, LZ4-compress each chunk before it is encrypted\n"
+              << "  --mac                 With --container, store an HMAC-SHA256 tag with every chunk\n"
+              << "  --chunk-size <size>   Plaintext bytes per --container or --incremental chunk, up to 1G (default: 1M)\n"
+              << "  --fsync               Flush every output file to disk before reporting it saved\n"
+              << "  --max-mem <size>      Keep buffer memory under size, e.g. 512M, by streaming and shrinking buffers,\n"
+              << "                        queue depth and threads; readers wait when it is used up\n"
+              << "  --profile <file>      Write per-stage times, bytes and throughput as JSON\n"
+              << "  --trace <file>        Write every timed stage as a Trace Event file (chrome://tracing, Perfetto)\n"
+              << "  --pipe                Encrypt or decrypt standard input to standard output and exit,\n"
+              << "                        e.g. tar c dir | enc --pipe --key k | ssh host 'cat > dir.enc'\n"
+              << "  --in-place            Encrypt or decrypt --input in place through a memory mapping and exit\n"
+              << "  --batch <src> <dst>   Encrypt every file under src into the same path under dst and exit\n"
+              << "  --summary <file>      Per-file CSV report for --batch (default: <dst>/batch_summary.csv)\n"
+              << "  --range <off> <len>   Decrypt only bytes off to off+len of --encrypted (container or raw)\n"
+              << "                        into --decrypted and exit\n"
+              << "  --incremental <file>  Encrypt --input into --encrypted, rewriting only the chunks that changed since\n"
+              << "                        the run that saved the manifest <file>, and exit\n"
+              << "  --verify <file>       Check every chunk tag of a --mac container, without the plaintext, and exit\n"
+              << "  --compare <a> <b>     Compare two files block by block and exit\n"
+              << "  --self-test           Check the XOR and cipher kernels against their references and the\n"
+              << "                        container format against forged files, and exit\n"
+              << "  --bench               Benchmark the kernels and ciphers in memory and print a JSON report\n"
+              << "  --bench-max <size>    Largest buffer in the --bench sweeps, 64 to 4G (default: 64M)\n"
+              << "  --bench-output <file> Write the --bench report to a file instead of standard output\n"
+              << "  --help                Show this message\n";
+}
+
+// Smallest --max-mem accepted, and the part of it left for everything that is not a data
+// buffer: thread stacks, the program image, chunk tables and manifests
+const uint64_t min_memory_budget = 16u << 20;
+const uint64_t memory_budget_overhead = 8u << 20;
+// Under --max-mem, fewer threads or a shallower queue are preferred over buffers smaller than this
+const size_t memory_budget_min_buffer = 256u << 10;
+
+/// <summary>
+/// Fits the options to --max-mem. The budget left after memory_budget_overhead caps the
+/// arena buffers (see MemoryBudget), and the settings are chosen so that a run stays under
+/// it: whole-file and mmap modes stream instead, since neither is bounded by the budget; then
+/// buffers shrink down to memory_budget_min_buffer, then the buffers in flight (queue depth,
+/// or threads for --batch and --mode pipeline) drop, then buffers shrink down to 4 KB.
+/// Container batches and chunks follow the budget through container_batch_size.
+/// </summary>
+void fit_memory_budget(ProgramOptions& options)
+{
+    if (options.max_memory == 0)
+    {
+        return;
+    }
+    const uint64_t budget = options.max_memory - memory_budget_overhead;
+    MemoryBudget::instance().set_limit(budget);
+
+    // Whole files are as large as the input, and mapped windows add to the resident size too
+    if (options.io_mode == IoMode::whole_file || options.io_mode == IoMode::mmap)
+    {
+        options.io_mode = IoMode::stream;
+    }
+    if (options.io_mode == IoMode::pipeline && !options.buffer_size_given)
+    {
+        options.buffer_size = default_stream_buffer_size;
+    }
+    options.container_chunk_size = std::min(options.container_chunk_size, container_batch_size());
+
+    // What a run holds at once: count buffers in flight times per_count buffers each
+    unsigned single = 1;
+    unsigned* count = &single;
+    unsigned min_count = 1;
+    uint64_t per_count = 1;
+    if (!options.batch_source.empty())
+    {
+        count = &options.thread_count; // one file per pool worker
+        per_count = options.io_mode == IoMode::direct ? 2 : 1;
+    }
+    else if (options.fused)
+    {
+        per_count = 2;
+    }
+    else if (options.io_mode == IoMode::pipeline)
+    {
+        count = &options.thread_count; // two chunks per thread
+        min_count = 2;
+        per_count = 2;
+    }
+    else if (options.io_mode == IoMode::uring || options.io_mode == IoMode::direct)
+    {
+        count = &options.queue_depth;
+        min_count = options.io_mode == IoMode::direct ? 2 : 1;
+    }
+
+    const auto cost = [&] {
+        return BufferArena::footprint(options.buffer_size) * std::bit_ceil(*count) * per_count;
+    };
+    const size_t requested_buffer = options.buffer_size;
+    const unsigned requested_count = *count;
+    const auto halve_buffer = [&] {
+        options.buffer_size = std::bit_floor(options.buffer_size - 1);
+    };
+    while (cost() > budget && options.buffer_size > memory_budget_min_buffer)
+    {
+        halve_buffer();
+    }
+    while (cost() > budget && *count > min_count)
+    {
+        --*count;
+    }
+    while (cost() > budget && options.buffer_size > arena_min_buffer_size)
+    {
+        halve_buffer();
+    }
+
+    if (options.buffer_size != requested_buffer || *count != requested_count)
+    {
+        options.buffer_size_given = true;
+        std::cerr << "--max-mem: using " << options.buffer_size << "-byte buffers";
+        if (count != &single)
+        {
+            std::cerr << (count == &options.queue_depth ? ", queue depth " : ", ") << *count
+                      << (count == &options.queue_depth ? "" : " threads");
+        }
+        std::cerr << std::endl;
+    }
+}
+
+/// <summary>
+/// Fills options from the command line.
+/// </summary>
+/// <returns>True if every argument was understood</returns>
+bool parse_arguments(int argc, char* argv[], ProgramOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (argument == "--help")
+        {
+            options.show_help = true;
+        }
+        else if (argument == "--self-test")
+        {
+            options.self_test = true;
+        }
+        else if (argument == "--bench")
+        {
+            options.benchmark = true;
+        }
+        else if (argument == "--bench-max" && has_value)
+        {
+            uint64_t size = 0;
+            if (!parse_size(argv[++i], size) || size < 64 || size > (4ull << 30) || size > SIZE_MAX - key_stream_alignment)
+            {
+                std::cerr << "Invalid benchmark size: " << argv[i] << "\n";
+                return false;
+            }
+            options.benchmark_max_size = size;
+        }
+        else if (argument == "--bench-output" && has_value)
+        {
+            options.benchmark_output = argv[++i];
+        }
+        else if (argument == "--batch" && i + 2 < argc)
+        {
+            options.batch_source = argv[++i];
+            options.batch_destination = argv[++i];
+        }
+        else if (argument == "--summary" && has_value)
+        {
+            options.batch_summary = argv[++i];
+        }
+        else if (argument == "--range" && i + 2 < argc)
+        {
+            // The offset may be zero, which parse_size rejects
+            const std::string offset = argv[++i];
+            if ((offset != "0" && !parse_size(offset, options.range_offset)) || !parse_size(argv[++i], options.range_length))
+            {
+                std::cerr << "Invalid range: " << offset << " " << argv[i] << "\n";
+                return false;
+            }
+            options.range_given = true;
+        }
+        else if (argument == "--compare" && i + 2 < argc)
+        {
+            options.compare_first = argv[++i];
+            options.compare_second = argv[++i];
+        }
+        else if (argument == "--fused")
+        {
+            options.fused = true;
+        }
+        else if (argument == "--paranoid")
+        {
+            options.paranoid = true;
+        }
+        else if (argument == "--container")
+        {
+            options.container = true;
+        }
+        else if (argument == "--compress")
+        {
+            options.compress = true;
+        }
+        else if (argument == "--mac")
+        {
+            options.chunk_tags = true;
+        }
+        else if (argument == "--verify" && has_value)
+        {
+            options.verify_filename = argv[++i];
+        }
+        else if (argument == "--incremental" && has_value)
+        {
+            options.incremental_manifest = argv[++i];
+        }
+        else if (argument == "--chunk-size" && has_value)
+        {
+            uint64_t size = 0;
+            if (!parse_size(argv[++i], size) || size > max_container_chunk_size)
+            {
+                std::cerr << "Invalid chunk size: " << argv[i] << "\n";
+                return false;
+            }
+            options.container_chunk_size = static_cast<size_t>(size);
+        }
+        else if (argument == "--fsync")
+        {
+            options.sync_output = true;
+        }
+        else if (argument == "--max-mem" && has_value)
+        {
+            if (!parse_size(argv[++i], options.max_memory) || options.max_memory < min_memory_budget)
+            {
+                std::cerr << "Invalid memory budget (at least 16M): " << argv[i] << "\n";
+                return false;
+            }
+        }
+        else if (argument == "--profile" && has_value)
+        {
+            options.profile_filename = argv[++i];
+        }
+        else if (argument == "--trace" && has_value)
+        {
+            options.trace_filename = argv[++i];
+        }
+        else if (argument == "--pipe")
+        {
+            options.pipe = true;
+        }
+        else if (argument == "--in-place")
+        {
+            options.in_place = true;
+        }
+        else if (argument == "--input" && has_value)
+        {
+            options.input_filename = argv[++i];
+        }
+        else if (argument == "--encrypted" && has_value)
+        {
+            options.encrypted_filename = argv[++i];
+        }
+        else if (argument == "--decrypted" && has_value)
+        {
+            options.decrypted_filename = argv[++i];
+        }
+        else if (argument == "--key" && has_value)
+        {
+            options.key = argv[++i];
+            if (options.key.empty())
+            {
+                std::cerr << "The key must not be empty.\n";
+                return false;
+            }
+        }
+        else if (argument == "--cipher" && has_value)
+        {
+            const std::string cipher = argv[++i];
+            if (cipher == "xor")
+            {
+                options.cipher = CipherKind::xor_key;
+            }
+            else if (cipher == "chacha20")
+            {
+                options.cipher = CipherKind::chacha20;
+            }
+            else if (cipher == "aes256-ctr")
+            {
+                options.cipher = CipherKind::aes256_ctr;
+            }
+            else
+            {
+                std::cerr << "Unknown cipher: " << cipher << "\n";
+                return false;
+            }
+        }
+        else if (argument == "--nonce" && has_value)
+        {
+            if (!parse_hex(argv[++i], options.nonce))
+            {
+                std::cerr << "Invalid nonce (expected 24 hex digits): " << argv[i] << "\n";
+                return false;
+            }
+        }
+        else if (argument == "--mode" && has_value)
+        {
+            const std::string mode = argv[++i];
+            if (mode == "whole")
+            {
+                options.io_mode = IoMode::whole_file;
+            }
+            else if (mode == "stream")
+            {
+                options.io_mode = IoMode::stream;
+            }
+            else if (mode == "mmap")
+            {
+                options.io_mode = IoMode::mmap;
+            }
+            else if (mode == "uring")
+            {
+                options.io_mode = IoMode::uring;
+            }
+            else if (mode == "pipeline")
+            {
+                options.io_mode = IoMode::pipeline;
+            }
+            else if (mode == "direct")
+            {
+                options.io_mode = IoMode::direct;
+            }
+            else
+            {
+                std::cerr << "Unknown mode: " << mode << "\n";
+                return false;
+            }
+        }
+        else if (argument == "--buffer-size" && has_value)
+        {
+            uint64_t size = 0;
+            if (!parse_size(argv[++i], size) || size > SIZE_MAX)
+            {
+                std::cerr << "Invalid buffer size: " << argv[i] << "\n";
+                return false;
+            }
+            options.buffer_size = static_cast<size_t>(size);
+            options.buffer_size_given = true;
+        }
+        else if (argument == "--queue-depth" && has_value)
+        {
+            uint64_t depth = 0;
+            if (!parse_size(argv[++i], depth) || depth > 4096)
+            {
+                std::cerr << "Invalid queue depth: " << argv[i] << "\n";
+                return false;
+            }
+            options.queue_depth = static_cast<unsigned>(depth);
+        }
+        else if (argument == "--threads" && has_value)
+        {
+            uint64_t count = 0;
+            if (!parse_size(argv[++i], count) || count > 1024)
+            {
+                std::cerr << "Invalid thread count: " << argv[i] << "\n";
+                return false;
+            }
+            options.thread_count = static_cast<unsigned>(count);
+        }
+        else
+        {
+            std::cerr << "Unrecognized argument: " << argument << "\n";
+            return false;
+        }
+    }
+
+    if (options.container && (options.fused || options.in_place))
+    {
+        std::cerr << "--container cannot be combined with --fused or --in-place.\n";
+        return false;
+    }
+    if ((options.chunk_tags || options.compress) && !options.container)
+    {
+        std::cerr << "--mac and --compress require --container.\n";
+        return false;
+    }
+
+    // Give every thread at least one chunk per buffer unless the size was chosen explicitly
+    if (!options.buffer_size_given)
+    {
+        options.buffer_size = std::max(options.buffer_size, options.thread_count * default_parallel_chunk_size);
+    }
+    fit_memory_budget(options);
+
+    return true;
+}
+
+/// <summary>
+/// Creates the cipher selected by the options, keyed from the passphrase, and calls
+/// function with it. This is the one place the cipher is chosen at run time: every cipher
+/// is its own type, so whatever function instantiates (the engine, the I/O drivers) is
+/// compiled once per cipher and calls it directly. XOR keys whose length divides 64 and is
+/// common enough to be worth the extra code get a FixedKeyXor, which is faster on short runs
+/// and the same as KeyStream on long ones; other lengths use KeyStream.
+/// </summary>
+/// <returns>What function returned</returns>
+template <typename Function>
+bool dispatch_cipher(const ProgramOptions& options, Function&& function)
+{
+    switch (options.cipher)
+    {
+    case CipherKind::chacha20:
+        return function(ChaCha20Cipher(Sha256::hash(options.key.data(), options.key.length()), options.nonce));
+    case CipherKind::aes256_ctr:
+    {
+        // Nonce in the high 96 bits and the block counter in the low 32, as in GCM; files past
+        // 64 GB carry into the nonce, so keep nonces of the same key far apart
+        AesCtrCipher::CounterBlock counter = {};
+        std::copy(options.nonce.begin(), options.nonce.end(), counter.begin());
+        return function(AesCtrCipher(Sha256::hash(options.key.data(), options.key.length()), counter));
+    }
+    default:
+        break;
+    }
+
+    switch (options.key.length())
+    {
+    case 8:
+        return function(FixedKeyXor<8>(options.key));
+    case 16:
+        return function(FixedKeyXor<16>(options.key));
+    case 32:
+        return function(FixedKeyXor<32>(options.key));
+    default:
+        return function(KeyStream(options.key));
+    }
+}
+
+/// <summary>
+/// Encrypts or decrypts one file into another using the I/O mode from the options.
+/// </summary>
+/// <returns>True if the output file was written</returns>
+template <typename Engine>
+bool transform_file(const std::string& input_filename, const std::string& output_filename,
+                    const ProgramOptions& options, Engine& engine)
+{
+    if (options.io_mode != IoMode::whole_file)
+    {
+        uint64_t bytes_processed = 0;
+        bool written = false;
+        switch (options.io_mode)
+        {
+        case IoMode::stream:
+            written = stream_transform_file(input_filename, output_filename, engine, options.buffer_size, bytes_processed);
+            break;
+        case IoMode::mmap:
+            written = mmap_transform_file(input_filename, output_filename, engine, bytes_processed);
+            break;
+        case IoMode::pipeline:
+            // The reader and writer threads mostly wait on I/O; the rest of the threads transform
+            written = pipeline_transform_file(input_filename, output_filename, engine.cipher(),
+                                              options.buffer_size_given ? options.buffer_size : default_stream_buffer_size,
+                                              std::max(2u, options.thread_count) - 1, bytes_processed);
+            break;
+        case IoMode::direct:
+            written = direct_transform_file(input_filename, output_filename, engine, options.buffer_size,
+                                            options.queue_depth, bytes_processed);
+            break;
+        default:
+            written = uring_transform_file(input_filename, output_filename, engine, options.buffer_size,
+                                           options.queue_depth, bytes_processed);
+            break;
+        }
+        if (!written)
+        {
+            return false;
+        }
+        if (bytes_processed == 0)
+        {
+            std::cerr << "No content read from input file: " << input_filename << std::endl;
+            return false;
+        }
+        return !options.sync_output || sync_file(output_filename);
+    }
+
+    std::string content = read_file(input_filename);
+    if (content.empty())
+    {
+        std::cerr << "No content read from input file: " << input_filename << std::endl;
+        return false;
+    }
+
+    StageTimer transform_timer("transform");
+    auto* bytes = reinterpret_cast<unsigned char*>(&content[0]);
+    engine.transform(bytes, bytes, content.size(), 0);
+    transform_timer.finish(content.size());
+    write_file(output_filename, content);
+    return !options.sync_output || sync_file(output_filename);
+}
+
+/// <summary>
+/// Runs the fused encrypt-and-verify flow. The round trip is checked in memory during the
+/// single pass; only --paranoid decrypts the written file and compares it with the input.
+/// </summary>
+/// <returns>True if the round trip verified</returns>
+template <typename Engine>
+bool run_fused_verification(const ProgramOptions& options, Engine& engine)
+{
+    FusedVerifyResult result;
+    const bool verified = fused_encrypt_verify(options.input_filename, options.encrypted_filename, engine,
+                                               options.buffer_size, result);
+    if (result.bytes_processed == 0)
+    {
+        std::cerr << "No content read from input file: " << options.input_filename << std::endl;
+        return false;
+    }
+    if (options.sync_output && !sync_file(options.encrypted_filename))
+    {
+        return false;
+    }
+    std::cout << "Encrypted file saved as: " << options.encrypted_filename << std::endl;
+
+    if (!verified)
+    {
+        std::cout << "ERROR: Round trip does NOT reproduce the original input.\n";
+        return false;
+    }
+    std::cout << "SUCCESS: Round trip verified in one pass (" << result.bytes_processed << " bytes, checksum "
+              << std::hex << std::setw(16) << std::setfill('0') << result.plaintext_checksum
+              << std::dec << std::setfill(' ') << ").\n";
+
+    if (!options.paranoid)
+    {
+        return true;
+    }
+
+    if (!transform_file(options.encrypted_filename, options.decrypted_filename, options, engine))
+    {
+        std::cerr << "Decryption failed." << std::endl;
+        return false;
+    }
+    std::cout << "Decrypted file saved as: " << options.decrypted_filename << std::endl;
+    return compare_files(options.input_filename, options.decrypted_filename);
+}
+
+/// <summary>
+/// The default flow: encrypts the input, decrypts the result and compares it with the input.
+/// </summary>
+/// <returns>True if the decrypted file matches the input</returns>
+template <typename Engine>
+bool run_round_trip(const ProgramOptions& options, Engine& engine)
+{
+    // Step 1: Encrypt the input
+    if (!transform_file(options.input_filename, options.encrypted_filename, options, engine))
+    {
+        std::cerr << "Encryption failed. Exiting." << std::endl;
+        return false;
+    }
+    std::cout << "Encrypted file saved as: " << options.encrypted_filename << std::endl;
+
+    // Step 2: Decrypt the encrypted file
+    if (!transform_file(options.encrypted_filename, options.decrypted_filename, options, engine))
+    {
+        std::cerr << "Decryption failed. Exiting." << std::endl;
+        return false;
+    }
+    std::cout << "Decrypted file saved as: " << options.decrypted_filename << std::endl;
+
+    // Step 3: Compare decrypted file with original
+    return compare_files(options.input_filename, options.decrypted_filename);
+}
+
+/// <summary>
+/// The round trip through a container: encrypts the input into a container, reopens it,
+/// decrypts it with the cipher and nonce its header records (checking the chunk tags, with
+/// --mac) and compares the result with the input. The container does its own I/O, so --mode does not apply.
+/// </summary>
+/// <returns>True if the decrypted file matches the input</returns>
+bool run_container_round_trip(const ProgramOptions& options)
+{
+    ContainerHeader header;
+    header.cipher = options.cipher;
+    header.nonce = options.nonce;
+    header.chunk_size = static_cast<uint32_t>(options.container_chunk_size);
+
+    const HmacSha256 authenticator = make_chunk_authenticator(options.key);
+    uint64_t bytes_processed = 0;
+    const bool written = dispatch_cipher(options, [&](auto cipher) {
+        ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+        return write_container(options.input_filename, options.encrypted_filename, engine, header,
+                               options.chunk_tags ? &authenticator : nullptr, options.compress, bytes_processed);
+    });
+    if (!written || (options.sync_output && !sync_file(options.encrypted_filename)))
+    {
+        std::cerr << "Encryption failed. Exiting." << std::endl;
+        return false;
+    }
+    if (bytes_processed == 0)
+    {
+        std::cerr << "No content read from input file: " << options.input_filename << std::endl;
+        return false;
+    }
+    std::cout << "Encrypted file saved as: " << options.encrypted_filename << std::endl;
+
+    ContainerReader container;
+    if (!container.open(options.encrypted_filename))
+    {
+        return false;
+    }
+    const auto compressed = std::count_if(container.chunks().begin(), container.chunks().end(), [](const ContainerChunk& chunk) {
+        return (chunk.flags & container_chunk_compressed) != 0;
+    });
+    std::cout << "Container: " << container.chunks().size() << " chunks, " << compressed << " compressed, "
+              << container.file().size() << " bytes for " << container.header().plaintext_size << " bytes of input"
+              << std::endl;
+    ProgramOptions recorded = options;
+    recorded.cipher = container.header().cipher;
+    recorded.nonce = container.header().nonce;
+    const bool extracted = dispatch_cipher(recorded, [&](auto cipher) {
+        ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+        return extract_container(container, options.decrypted_filename, engine, authenticator, bytes_processed);
+    });
+    if (!extracted || (options.sync_output && !sync_file(options.decrypted_filename)))
+    {
+        std::cerr << "Decryption failed. Exiting." << std::endl;
+        return false;
+    }
+    std::cout << "Decrypted file saved as: " << options.decrypted_filename << " (" << container.chunks().size()
+              << (container.tagged() ? " authenticated" : "") << " chunks)" << std::endl;
+
+    return compare_files(options.input_filename, options.decrypted_filename);
+}
+
+/// <summary>
+/// Decrypts plaintext bytes [offset, offset + length) of raw ciphertext, as written by the
+/// non-container modes. Ciphertext byte i is plaintext byte i, so exactly length bytes are
+/// read, and the cipher is seeked to offset: the key phase for XOR, the block counter for
+/// ChaCha20 and AES-CTR.
+/// </summary>
+/// <returns>True if the bytes could be read</returns>
+template <typename Engine>
+bool decrypt_raw_range(const RandomAccessFile& file, Engine& engine, uint64_t offset, size_t length,
+                       unsigned char* destination)
+{
+    StageTimer read_timer("read");
+    if (!file.read_at(destination, length, offset))
+    {
+        return false;
+    }
+    read_timer.finish(length);
+
+    StageTimer transform_timer("transform");
+    engine.transform(destination, destination, length, offset);
+    transform_timer.finish(length);
+    return true;
+}
+
+/// <summary>
+/// Decrypts plaintext bytes [offset, offset + length) of a container. The first chunk is
+/// found by binary search on the plaintext offsets in the chunk table, and only the part of
+/// each overlapping chunk that falls inside the range is read and decrypted. In a tagged
+/// container a tag covers its whole chunk, so overlapping chunks are read whole and
+/// checked before any of their bytes are returned; compressed chunks are also read whole,
+/// decrypted and expanded.
+/// </summary>
+/// <returns>True if the bytes could be read (and, if tagged, were authentic)</returns>
+template <typename Engine>
+bool decrypt_container_range(const ContainerReader& container, Engine& engine, const HmacSha256& authenticator,
+                             uint64_t offset, size_t length, unsigned char* destination)
+{
+    std::vector<unsigned char> stored;
+    std::vector<unsigned char> unpacked;
+    const std::vector<ContainerChunk>& chunks = container.chunks();
+    auto chunk = std::upper_bound(chunks.begin(), chunks.end(), offset, [](uint64_t value, const ContainerChunk& c) {
+        return value < c.plaintext_offset;
+    });
+    assert(chunk != chunks.begin());
+    --chunk;
+
+    for (size_t done = 0; done < length; ++chunk)
+    {
+        assert(chunk != chunks.end());
+        const uint64_t position = offset + done;
+        const uint64_t skip = position - chunk->plaintext_offset;
+        const auto piece = static_cast<size_t>(std::min<uint64_t>(length - done, chunk->plaintext_length - skip));
+        const bool compressed = (chunk->flags & container_chunk_compressed) != 0;
+        if (container.tagged() || compressed)
+        {
+            StageTimer read_timer("read");
+            stored.resize(static_cast<size_t>(container.footprint(*chunk)));
+            if (!container.file().read_at(stored.data(), stored.size(), chunk->offset))
+            {
+                return false;
+            }
+            read_timer.finish(stored.size());
+
+            StageTimer verify_timer("verify");
+            Sha256::Digest expected;
+            if (container.tagged())
+            {
+                std::copy(stored.end() - container_tag_size, stored.end(), expected.begin());
+            }
+            if (container.tagged() &&
+                !HmacSha256::equal(chunk_tag(authenticator, container.header_bytes(), *chunk, stored.data()), expected))
+            {
+                std::cerr << "Chunk " << (chunk - container.chunks().begin()) << " (bytes " << chunk->plaintext_offset
+                          << " to " << chunk->plaintext_offset + chunk->plaintext_length << ") failed authentication"
+                          << std::endl;
+                return false;
+            }
+            verify_timer.finish(container.tagged() ? chunk->stored_length : 0);
+
+            StageTimer transform_timer("transform");
+            if (!compressed)
+            {
+                engine.transform(destination + done, stored.data() + skip, piece, position);
+                transform_timer.finish(piece);
+                done += piece;
+                continue;
+            }
+            engine.transform(stored.data(), stored.data(), chunk->stored_length, chunk->plaintext_offset);
+            transform_timer.finish(chunk->stored_length);
+
+            StageTimer decompress_timer("decompress");
+            unpacked.resize(chunk->plaintext_length);
+            if (!lz4_decompress(stored.data(), chunk->stored_length, unpacked.data(), unpacked.size()))
+            {
+                std::cerr << "Chunk " << (chunk - container.chunks().begin()) << " (bytes " << chunk->plaintext_offset
+                          << " to " << chunk->plaintext_offset + chunk->plaintext_length << ") could not be decompressed"
+                          << std::endl;
+                return false;
+            }
+            decompress_timer.finish(unpacked.size());
+            std::memcpy(destination + done, unpacked.data() + skip, piece);
+            done += piece;
+            continue;
+        }
+
+        StageTimer read_timer("read");
+        if (!container.file().read_at(destination + done, piece, chunk->offset + skip))
+        {
+            return false;
+        }
+        read_timer.finish(piece);
+
+        // Each chunk is encrypted at its plaintext offset, not at its offset in the container
+        StageTimer transform_timer("transform");
+        engine.transform(destination + done, destination + done, piece, position);
+        transform_timer.finish(piece);
+        done += piece;
+    }
+    return true;
+}
+
+/// <summary>
+/// Self-test of the container format, in a scratch directory under the system temp
+/// directory: a tagged and compressed container round trip, a range read across a chunk
+/// boundary, and two forged containers that must be rejected, one with a chunk that points
+/// past the chunk table and one with an oversized chunk size.
+/// </summary>
+/// <returns>True if every container check passed</returns>
+bool run_container_self_test()
+{
+    std::cout << "Container format:\n";
+    std::error_code error;
+    const std::filesystem::path directory = std::filesystem::temp_directory_path(error) /
+        ("cs405-self-test-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    if (error || !std::filesystem::create_directories(directory, error))
+    {
+        std::cerr << "Unable to create a scratch directory for the container tests" << std::endl;
+        return false;
+    }
+    const std::string plain_filename = (directory / "plain").string();
+    const std::string container_filename = (directory / "container").string();
+    const std::string extracted_filename = (directory / "extracted").string();
+    const std::string forged_filename = (directory / "forged").string();
+
+    // Compressible text followed by random bytes, so some chunks are stored compressed and some not
+    std::string plain;
+    for (int line = 0; plain.size() < 40000; ++line)
+    {
+        plain += "line " + std::to_string(line) + " of the container self-test\n";
+    }
+    uint32_t seed = 0x9e3779b9u;
+    while (plain.size() < 70001)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        plain += static_cast<char>(seed >> 24);
+    }
+    std::ofstream(plain_filename, std::ios::out | std::ios::binary).write(plain.data(), static_cast<std::streamsize>(plain.size()));
+
+    const std::string key = "container self-test";
+    const HmacSha256 authenticator = make_chunk_authenticator(key);
+    ParallelCipherEngine engine(KeyStream(key), 2, 1000);
+    ContainerHeader header;
+    header.chunk_size = 4096;
+    uint64_t bytes_processed = 0;
+    ContainerReader container;
+    bool round_trip_passed =
+        write_container(plain_filename, container_filename, engine, header, &authenticator, true, bytes_processed) &&
+        container.open(container_filename) && container.tagged() &&
+        std::any_of(container.chunks().begin(), container.chunks().end(), [](const ContainerChunk& chunk) {
+            return (chunk.flags & container_chunk_compressed) != 0;
+        }) &&
+        extract_container(container, extracted_filename, engine, authenticator, bytes_processed);
+    round_trip_passed = round_trip_passed && read_file(extracted_filename) == plain;
+    std::cout << "  " << std::left << std::setw(8) << "trip" << (round_trip_passed ? " passed" : " FAILED") << "\n";
+
+    // One range inside the compressed text, one across the switch to stored chunks
+    bool range_passed = round_trip_passed;
+    for (const uint64_t offset : { uint64_t(4096 - 100), uint64_t(40960 - 3000) })
+    {
+        std::string range(6000, '\0');
+        range_passed = range_passed &&
+                       decrypt_container_range(container, engine, authenticator, offset, range.size(),
+                                               reinterpret_cast<unsigned char*>(&range[0])) &&
+                       range == plain.substr(static_cast<size_t>(offset), range.size());
+    }
+    std::cout << "  " << std::left << std::setw(8) << "range" << (range_passed ? " passed" : " FAILED") << "\n";
+
+    // Forgeries carry valid checksums, so only the bounds checks can catch them
+    const std::string genuine = read_file(container_filename);
+    const auto forged_is_rejected = [&](const std::string& bytes) {
+        std::ofstream(forged_filename, std::ios::out | std::ios::binary | std::ios::trunc)
+            .write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        // The rejection is expected, so its message is kept off the console
+        std::ostringstream discarded;
+        std::streambuf* const console = std::cerr.rdbuf(discarded.rdbuf());
+        ContainerReader forged;
+        const bool opened = forged.open(forged_filename);
+        std::cerr.rdbuf(console);
+        return !opened;
+    };
+    bool forged_passed = genuine.size() > container_header_size + container_footer_size;
+    if (forged_passed)
+    {
+        // The last chunk moved onto the footer, past the table; the table checksum is redone
+        std::string bytes = genuine;
+        auto* data = reinterpret_cast<unsigned char*>(&bytes[0]);
+        const size_t footer = bytes.size() - container_footer_size;
+        const auto table_offset = static_cast<size_t>(load_le(data + footer, 8));
+        store_le(data + footer - container_entry_size, footer, 8);
+        store_le(data + footer + 16, Xxh64::hash(data + table_offset, footer - table_offset), 8);
+        forged_passed = forged_is_rejected(bytes);
+
+        // A chunk size above the --chunk-size limit; the header checksum is redone
+        bytes = genuine;
+        data = reinterpret_cast<unsigned char*>(&bytes[0]);
+        store_le(data + 16, max_container_chunk_size + 1, 4);
+        store_le(data + 56, Xxh64::hash(data, 56), 8);
+        forged_passed = forged_passed && forged_is_rejected(bytes);
+    }
+    std::cout << "  " << std::left << std::setw(8) << "forged" << (forged_passed ? " passed" : " FAILED") << "\n";
+
+    std::filesystem::remove_all(directory, error);
+    return round_trip_passed && range_passed && forged_passed;
+}
+
+/// <summary>
+/// Writes plaintext bytes [offset, offset + length) of an encrypted file to
+/// options.decrypted_filename without decrypting the rest: pulling a few KB out of the
+/// middle of a 100 GB file reads a few KB. The file may be a container, which brings its
+/// own cipher and nonce, or raw ciphertext, which is decrypted with the options' cipher.
+/// A range reaching past the end of the plaintext is cut short.
+/// </summary>
+/// <returns>True if the range was written</returns>
+bool decrypt_range(const ProgramOptions& options, uint64_t offset, uint64_t length)
+{
+    const std::string& filename = options.encrypted_filename;
+    RandomAccessFile file;
+    if (!file.open_read(filename))
+    {
+        std::cerr << "Unable to open file: " << filename << std::endl;
+        return false;
+    }
+
+    unsigned char magic[sizeof(container_magic)] = {};
+    const bool is_container = file.size() >= container_header_size + container_footer_size &&
+                              file.read_at(magic, sizeof(magic), 0) &&
+                              std::memcmp(magic, container_magic, sizeof(magic)) == 0;
+    ContainerReader container;
+    ProgramOptions cipher_options = options;
+    uint64_t plaintext_size = file.size();
+    if (is_container)
+    {
+        if (!container.open(filename))
+        {
+            return false;
+        }
+        cipher_options.cipher = container.header().cipher;
+        cipher_options.nonce = container.header().nonce;
+        plaintext_size = container.header().plaintext_size;
+    }
+
+    if (offset >= plaintext_size)
+    {
+        std::cerr << "Range starts past the end of the plaintext (" << plaintext_size << " bytes)" << std::endl;
+        return false;
+    }
+    length = std::min(length, plaintext_size - offset);
+
+    RandomAccessFile output;
+    if (!output.create(options.decrypted_filename))
+    {
+        std::cerr << "Unable to open file for writing: " << options.decrypted_filename << std::endl;
+        return false;
+    }
+
+    const HmacSha256 authenticator = make_chunk_authenticator(options.key);
+    const bool decrypted = dispatch_cipher(cipher_options, [&](auto cipher) {
+        ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+        const auto capacity = static_cast<size_t>(std::min<uint64_t>(length, options.buffer_size));
+        const BufferArena::Buffer buffer = BufferArena::local().acquire(capacity);
+        for (uint64_t done = 0; done < length;)
+        {
+            const auto piece = static_cast<size_t>(std::min<uint64_t>(length - done, capacity));
+            const bool read = is_container
+                ? decrypt_container_range(container, engine, authenticator, offset + done, piece, buffer.get())
+                : decrypt_raw_range(file, engine, offset + done, piece, buffer.get());
+            if (!read)
+            {
+                std::cerr << "Unable to decrypt range from file: " << filename << std::endl;
+                return false;
+            }
+
+            StageTimer write_timer("write");
+            const ConstBuffer written{ buffer.get(), piece };
+            if (!output.write_gathered(std::span<const ConstBuffer>(&written, 1)))
+            {
+                std::cerr << "Error writing to file: " << options.decrypted_filename << std::endl;
+                return false;
+            }
+            write_timer.finish(piece);
+            done += piece;
+        }
+        return true;
+    });
+    if (!decrypted || !output.close())
+    {
+        return false;
+    }
+
+    std::cout << "Decrypted bytes " << offset << " to " << offset + length << " of " << filename
+              << (is_container ? " (container)" : "") << " into " << options.decrypted_filename << std::endl;
+    return true;
+}
+
+/// <summary>
+/// Checks every chunk tag of a tagged container without decrypting anything or needing the
+/// original plaintext, and reports each chunk that fails.
+/// </summary>
+/// <returns>True if every chunk is authentic</returns>
+bool verify_container(const ProgramOptions& options, const std::string& filename)
+{
+    ContainerReader container;
+    if (!container.open(filename))
+    {
+        return false;
+    }
+    if (!container.tagged())
+    {
+        std::cerr << "Container has no chunk tags to verify: " << filename << std::endl;
+        return false;
+    }
+
+    const HmacSha256 authenticator = make_chunk_authenticator(options.key);
+    // Only the threads are needed here; the cipher is never applied
+    ParallelCipherEngine engine(KeyStream(options.key), options.thread_count);
+    std::vector<unsigned char> rejected;
+    size_t failures = 0;
+    const bool read = read_container_batches(container, [&](size_t first, size_t last, unsigned char* data) {
+        failures += verify_chunk_tags(container, engine, authenticator, first, last, data, rejected);
+        return true;
+    });
+    if (!read)
+    {
+        return false;
+    }
+
+    if (failures > 0)
+    {
+        std::cout << "ERROR: " << failures << " of " << container.chunks().size() << " chunks of " << filename
+                  << " failed authentication.\n";
+        return false;
+    }
+    std::cout << "SUCCESS: All " << container.chunks().size() << " chunks of " << filename << " ("
+              << container.header().plaintext_size << " bytes) are authentic.\n";
+    return true;
+}
+
+/// <summary>
+/// Encrypts --input into --encrypted incrementally: only the chunks whose ciphertext differs
+/// from the previous run, according to the manifest, are written.
+/// </summary>
+/// <returns>True if the ciphertext and the manifest are up to date</returns>
+bool run_incremental(const ProgramOptions& options)
+{
+    IncrementalResult result;
+    const auto start = std::chrono::steady_clock::now();
+    const bool updated = dispatch_cipher(options, [&](auto cipher) {
+        ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+        return incremental_transform_file(options.input_filename, options.encrypted_filename, options.incremental_manifest,
+                                          engine, options.container_chunk_size, options.sync_output, result);
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!updated)
+    {
+        return false;
+    }
+
+    std::cout << "Rewrote " << result.chunks_rewritten << " of " << result.chunk_count << " chunks ("
+              << result.bytes_written << " bytes) of " << options.encrypted_filename << " in " << std::fixed
+              << std::setprecision(3) << seconds << " s\n"
+              << "Manifest: " << options.incremental_manifest << std::endl;
+    return true;
+}
+
+/// <summary>
+/// Runs batch mode: encrypts a whole directory tree on a work-stealing pool, writes the
+/// per-file summary and prints totals.
+/// </summary>
+/// <returns>True if every file was encrypted</returns>
+bool run_batch(const ProgramOptions& options)
+{
+    std::error_code error;
+    if (!std::filesystem::is_directory(options.batch_source, error))
+    {
+        std::cerr << "Not a directory: " << options.batch_source << std::endl;
+        return false;
+    }
+
+    // A destination inside the source would have its own outputs listed and encrypted again
+    const std::filesystem::path source = std::filesystem::weakly_canonical(options.batch_source, error);
+    const std::filesystem::path destination = std::filesystem::weakly_canonical(options.batch_destination, error);
+    if (error || std::mismatch(source.begin(), source.end(), destination.begin(), destination.end()).first == source.end())
+    {
+        std::cerr << "Destination must not be inside the source: " << options.batch_destination << std::endl;
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<BatchFileResult> results;
+    dispatch_cipher(options, [&](auto cipher) {
+        // Parallelism comes from encrypting many files at once, so each file uses one thread
+        ParallelCipherEngine engine(std::move(cipher), 1);
+        results = encrypt_directory_tree(options.batch_source, options.batch_destination, engine,
+                                         options.buffer_size, options.thread_count, options.sync_output,
+                                         options.io_mode == IoMode::direct);
+        return true;
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t total_bytes = 0;
+    size_t failures = 0;
+    for (const BatchFileResult& result : results)
+    {
+        total_bytes += result.bytes;
+        failures += result.succeeded ? 0 : 1;
+    }
+
+    const std::string summary_filename = !options.batch_summary.empty()
+        ? options.batch_summary
+        : (std::filesystem::path(options.batch_destination) / "batch_summary.csv").string();
+    const bool summary_written = write_batch_summary(summary_filename, results);
+
+    std::cout << "Encrypted " << (results.size() - failures) << " of " << results.size() << " files ("
+              << total_bytes << " bytes) in " << std::fixed << std::setprecision(3) << seconds << " s using "
+              << options.thread_count << " threads\n";
+    if (summary_written)
+    {
+        std::cout << "Summary saved as: " << summary_filename << std::endl;
+    }
+    return failures == 0 && summary_written;
+}
+
+/// <summary>
+/// Writes the --profile and --trace reports requested in the options.
+/// </summary>
+/// <returns>True if every requested report was written</returns>
+bool write_profile_reports(const ProgramOptions& options)
+{
+    bool written = true;
+    if (!options.profile_filename.empty())
+    {
+        std::ofstream report(options.profile_filename);
+        StageProfiler::instance().write_summary(report);
+        if (!report)
+        {
+            std::cerr << "Unable to write profile: " << options.profile_filename << std::endl;
+            written = false;
+        }
+    }
+    if (!options.trace_filename.empty())
+    {
+        std::ofstream trace(options.trace_filename);
+        StageProfiler::instance().write_trace(trace);
+        if (!trace)
+        {
+            std::cerr << "Unable to write trace: " << options.trace_filename << std::endl;
+            written = false;
+        }
+    }
+    return written;
+}
+
+/// <summary>
+/// Runs the mode selected by the options (see main).
+/// </summary>
+/// <returns>The process exit code</returns>
+int run_program(const ProgramOptions& options)
+{
+    if (options.self_test)
+    {
+        const bool passed = run_self_test();
+        return run_container_self_test() && passed ? 0 : 1;
+    }
+
+    if (options.benchmark)
+    {
+        if (options.benchmark_output.empty())
+        {
+            return run_benchmarks(options.benchmark_max_size, std::cout) ? 0 : 1;
+        }
+        std::ofstream report(options.benchmark_output);
+        if (!report)
+        {
+            std::cerr << "Unable to open file for writing: " << options.benchmark_output << std::endl;
+            return 1;
+        }
+        return run_benchmarks(options.benchmark_max_size, report) ? 0 : 1;
+    }
+
+    if (!options.batch_source.empty())
+    {
+        return run_batch(options) ? 0 : 1;
+    }
+
+    if (!options.verify_filename.empty())
+    {
+        return verify_container(options, options.verify_filename) ? 0 : 1;
+    }
+
+    if (options.range_given)
+    {
+        return decrypt_range(options, options.range_offset, options.range_length) ? 0 : 1;
+    }
+
+    if (!options.incremental_manifest.empty())
+    {
+        return run_incremental(options) ? 0 : 1;
+    }
+
+    if (!options.compare_first.empty())
+    {
+        return compare_files(options.compare_first, options.compare_second) ? 0 : 1;
+    }
+
+    if (options.pipe)
+    {
+        // Standard output carries the data, so nothing else may be printed to it
+        return dispatch_cipher(options, [&](auto cipher) {
+            ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+            uint64_t bytes_processed = 0;
+            return pipe_transform(engine, options.buffer_size, bytes_processed);
+        }) ? 0 : 1;
+    }
+
+    if (options.in_place)
+    {
+        const bool transformed = dispatch_cipher(options, [&](auto cipher) {
+            ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+            uint64_t bytes_processed = 0;
+            if (!mmap_transform_in_place(options.input_filename, engine, bytes_processed) ||
+                (options.sync_output && !sync_file(options.input_filename)))
+            {
+                return false;
+            }
+            std::cout << "Transformed " << bytes_processed << " bytes of " << options.input_filename << " in place" << std::endl;
+            return true;
+        });
+        return transformed ? 0 : 1;
+    }
+
+    std::cout << "Encryption and Decryption Program\n";
+    if (options.container)
+    {
+        return run_container_round_trip(options) ? 0 : 1;
+    }
+    const bool succeeded = dispatch_cipher(options, [&](auto cipher) {
+        ParallelCipherEngine engine(std::move(cipher), options.thread_count);
+        return options.fused ? run_fused_verification(options, engine) : run_round_trip(options, engine);
+    });
+    return succeeded ? 0 : 1;
+}
+
+/// <summary>
+/// Main program function that:
+/// 1. Encrypts the input file (repeating-key XOR, or ChaCha20 / AES-256-CTR with --cipher)
+/// 2. Saves the encrypted result
+/// 3. Decrypts the encrypted file
+/// 4. Saves the decrypted result
+/// 5. Verifies the decrypted output matches the original input
+/// With --mode stream the files are processed through one fixed-size buffer, and with
+/// --mode mmap they are memory-mapped, instead of being loaded whole.
+/// --fused replaces steps 2 to 5 with a single-pass round-trip check (see run_fused_verification),
+/// and --container stores the ciphertext as a chunked binary container (see write_container).
+/// --in-place transforms the input file itself, --batch encrypts a directory tree, --range
+/// decrypts part of an encrypted file, --verify checks a container's chunk tags,
+/// --incremental rewrites only the changed chunks of a ciphertext, --pipe filters standard
+/// input to standard output and --compare checks two files; each of them exits afterwards.
+/// Passing --self-test verifies the XOR and cipher kernels and exits; --bench measures them
+/// in memory and prints a JSON report.
+/// --profile and --trace time every open, read, transform, write, fsync and compare of the
+/// run and write the reports when it finishes. --max-mem fits any of the modes to a memory
+/// budget (see fit_memory_budget).
+/// </summary>
+int main(int argc, char* argv[])
+{
+    ProgramOptions options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (options.show_help)
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    const bool profiling = !options.profile_filename.empty() || !options.trace_filename.empty();
+    if (profiling)
+    {
+        StageProfiler::instance().enable();
+    }
+
+    const int status = run_program(options);
+    if (options.max_memory != 0)
+    {
+        std::cerr << "Peak buffer memory: " << MemoryBudget::instance().peak() << " of "
+                  << MemoryBudget::instance().limit() << " bytes" << std::endl;
+    }
+
+    if (profiling && !write_profile_reports(options))
+    {
+        return 1;
+    }
+    return status;
+}